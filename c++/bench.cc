@@ -0,0 +1,416 @@
+#include "namegen.h"
+#include "../c/namegen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// Allocations made by the current thread, counted by operator new below
+// so that nothing outside this file is needed to see them.
+static thread_local size_t allocations = 0;
+static thread_local size_t allocated = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	allocated += size;
+	if (void* p = malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+
+static const struct {
+	const char* name;
+	const char* pattern;
+} patterns[] = {
+	{"MIDDLE_EARTH", MIDDLE_EARTH},
+	{"JAPANESE_NAMES_CONSTRAINED", JAPANESE_NAMES_CONSTRAINED},
+	{"JAPANESE_NAMES_DIVERSE", JAPANESE_NAMES_DIVERSE},
+	{"CHINESE_NAMES", CHINESE_NAMES},
+	{"GREEK_NAMES", GREEK_NAMES},
+	{"HAWAIIAN_NAMES_1", HAWAIIAN_NAMES_1},
+	{"HAWAIIAN_NAMES_2", HAWAIIAN_NAMES_2},
+	{"OLD_LATIN_PLACE_NAMES", OLD_LATIN_PLACE_NAMES},
+	{"DRAGONS_PERN", DRAGONS_PERN},
+	{"DRAGON_RIDERS", DRAGON_RIDERS},
+	{"POKEMON", POKEMON},
+	{"FANTASY_VOWELS_R", FANTASY_VOWELS_R},
+	{"FANTASY_S_A", FANTASY_S_A},
+	{"FANTASY_H_L", FANTASY_H_L},
+	{"FANTASY_N_L", FANTASY_N_L},
+	{"FANTASY_K_N", FANTASY_K_N},
+	{"FANTASY_J_G_Z", FANTASY_J_G_Z},
+	{"FANTASY_K_J_Y", FANTASY_K_J_Y},
+	{"FANTASY_S_E", FANTASY_S_E},
+};
+
+static const struct {
+	const char* name;
+	NameGen::Rng::engines_t engine;
+} engines[] = {
+	{"xoshiro256", NameGen::Rng::xoshiro256},
+	{"pcg32", NameGen::Rng::pcg32},
+	{"wyrand", NameGen::Rng::wyrand},
+	{"mt19937", NameGen::Rng::mt19937},
+};
+
+
+static std::string repeat(const std::string& s, size_t n)
+{
+	std::string out;
+	for (size_t i = 0; i < n; i++) {
+		out += s;
+	}
+	return out;
+}
+
+// Patterns at the edges of what the parsers and generators handle.
+static std::vector<std::pair<std::string, std::string>> pathological()
+{
+	std::string distinct = "(";
+	for (int i = 0; i < 10000; i++) {
+		distinct += (i ? "|" : "") + std::to_string(i);
+	}
+	distinct += ")";
+	return {
+		{"deep_nesting", repeat("<", 256) + "s" + repeat(">", 256)},
+		{"deep_wrappers", repeat("~!", 256) + "<sv>"},
+		{"huge_alternation", distinct},
+		{"huge_repeated_alternation", "(" + repeat("a|", 9999) + "b)"},
+		{"huge_symbol_alternation", "<" + repeat("s|v|c|B|C|", 2000) + "i>"},
+		{"long_literal", "(" + repeat("x", 10000) + ")"},
+		{"many_symbols", repeat("s", 1000)},
+		{"weighted", "(a^1000|b^10|c)" + repeat("<s^3|v|c^2>", 10)},
+	};
+}
+
+
+// Output, as aligned columns or as one JSON object per line.
+class Report
+{
+	bool json;
+	std::string section;
+	std::vector<std::pair<std::string, std::string>> fields;
+
+public:
+	Report(bool json_) :
+		json(json_)
+	{
+	}
+
+	Report& add(const char* key, const std::string& value)
+	{
+		std::string quoted = "\"";
+		for (char c : value) {
+			if (c == '"' || c == '\\') {
+				quoted += '\\';
+				quoted += c;
+			} else if ((unsigned char)c < 0x20) {
+				char escaped[8];
+				snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+				quoted += escaped;
+			} else {
+				quoted += c;
+			}
+		}
+		fields.emplace_back(key, quoted + "\"");
+		return *this;
+	}
+
+	Report& add(const char* key, double value)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), value >= 100 || value == (long long)value ? "%.0f" : "%.3f", value);
+		fields.emplace_back(key, buf);
+		return *this;
+	}
+
+	// Print the fields added since the last row, under `section_'.
+	void row(const char* section_)
+	{
+		if (json) {
+			printf("{\"section\": \"%s\"", section_);
+			for (auto& f : fields) {
+				printf(", \"%s\": %s", f.first.c_str(), f.second.c_str());
+			}
+			printf("}\n");
+		} else {
+			if (section != section_) {
+				printf("%s# %s\n", section.empty() ? "" : "\n", section_);
+				for (size_t i = 0; i < fields.size(); i++) {
+					printf(i ? " %12s" : "%-28s", fields[i].first.c_str());
+				}
+				printf("\n");
+			}
+			for (size_t i = 0; i < fields.size(); i++) {
+				std::string value = fields[i].second;
+				if (value[0] == '"') {
+					value = value.substr(1, value.size() - 2);
+				}
+				printf(i ? " %12s" : "%-28s", value.c_str());
+			}
+			printf("\n");
+		}
+		fflush(stdout);
+		section = section_;
+		fields.clear();
+	}
+};
+
+
+// Microseconds per call of `f', averaged over at least `seconds'.
+template<typename F>
+static double timing(F f, double seconds)
+{
+	unsigned long count = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed;
+	do {
+		f();
+		count++;
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed.count() < seconds);
+	return elapsed.count() * 1e6 / count;
+}
+
+
+// Names per second, nanoseconds per name, and allocations per name of
+// `generate'. Names are timed in batches of 16 to keep the clock's own
+// cost out of them, so the percentiles are over batch averages.
+template<typename F>
+static void measure(Report& report, F generate, double seconds)
+{
+	const int batch = 16;
+	std::string name;
+	for (int i = 0; i < batch; i++) {
+		name.clear();
+		generate(name);
+	}
+
+	std::vector<double> samples;
+	size_t allocations_made = 0;
+	size_t bytes_allocated = 0;
+	size_t length = 0;
+	auto start = std::chrono::steady_clock::now();
+	auto last = start;
+	std::chrono::duration<double> elapsed;
+	do {
+		size_t allocations_before = allocations;
+		size_t allocated_before = allocated;
+		for (int i = 0; i < batch; i++) {
+			name.clear();
+			generate(name);
+			length += name.size();
+		}
+		auto now = std::chrono::steady_clock::now();
+		allocations_made += allocations - allocations_before;
+		bytes_allocated += allocated - allocated_before;
+		samples.push_back(std::chrono::duration<double, std::nano>(now - last).count() / batch);
+		last = now;
+		elapsed = now - start;
+	} while (elapsed.count() < seconds);
+
+	double names = samples.size() * batch;
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&](double p) {
+		return samples[std::min(samples.size() - 1, size_t(p * samples.size()))];
+	};
+	report.add("names/s", names / elapsed.count())
+	      .add("ns_p50", percentile(0.50))
+	      .add("ns_p90", percentile(0.90))
+	      .add("ns_p99", percentile(0.99))
+	      .add("ns_max", samples.back())
+	      .add("allocs/name", allocations_made / names)
+	      .add("bytes/name", bytes_allocated / names)
+	      .add("length", length / names);
+}
+
+
+// Time to compile a pattern, and what it compiles to.
+static void compiling(Report& report, const std::string& label, const std::string& text, double seconds)
+{
+	NameGen::Generator generator(text);
+	NameGen::Program program(generator);
+	report.add("pattern", label)
+	      .add("bytes", text.size())
+	      .add("us/tree", timing([&]() { NameGen::Generator g(text); }, seconds))
+	      .add("us/program", timing([&]() { NameGen::Program p(text); }, seconds))
+	      .add("nodes", NameGen::Generator(text, true, false).nodes())
+	      .add("optimized", generator.nodes())
+	      .add("tree_memory", generator.memory())
+	      .add("program_memory", program.memory())
+	      .row("compile");
+}
+
+
+// Names from a pattern through every engine.
+static void generating(Report& report, const std::string& label, const std::string& text, double seconds)
+{
+	NameGen::Generator generator(text);
+	NameGen::Program program(generator);
+	NameGen::Rng rng(1);
+	report.add("pattern", label).add("engine", "tree");
+	measure(report, [&](std::string& out) { generator.generate(out, rng); }, seconds);
+	report.row("generate");
+
+	report.add("pattern", label).add("engine", "program");
+	measure(report, [&](std::string& out) { program.generate(out, rng); }, seconds);
+	report.row("generate");
+
+	report.add("pattern", label).add("engine", "direct");
+	measure(report, [&](std::string& out) { NameGen::generate(out, text, rng); }, seconds);
+	report.row("generate");
+
+	// The C version has neither ~ nor weights, nor collapsing, and a
+	// fixed depth, so it serves only as a baseline for speed.
+	static char buf[1 << 16];
+	unsigned long seed = 0xb9584b61UL;
+	if (namegen(buf, sizeof(buf), text.c_str(), &seed) == NAMEGEN_SUCCESS) {
+		report.add("pattern", label).add("engine", "c");
+		measure(report, [&](std::string& out) {
+			namegen(buf, sizeof(buf), text.c_str(), &seed);
+			out.assign(buf);
+		}, seconds);
+		report.row("generate");
+	}
+}
+
+
+// Generate `count' names from a shared, immutable generator using a
+// private Rng, as every worker thread in a server would.
+template<typename T>
+static void worker(const T& generator, unsigned long count, uint32_t seed, NameGen::Rng::engines_t engine, size_t& total)
+{
+	NameGen::Rng rng(seed, engine);
+	std::string name;
+	size_t length = 0;
+	for (unsigned long i = 0; i < count; i++) {
+		name.clear();
+		generator.generate(name, rng);
+		length += name.size();
+	}
+	total = length;
+}
+
+
+// Names per second with `threads' threads sharing one generator.
+template<typename T>
+static double scaling(const T& generator, unsigned threads, unsigned long count,
+                      NameGen::Rng::engines_t engine=NameGen::Rng::xoshiro256)
+{
+	std::vector<std::thread> pool;
+	std::vector<size_t> totals(threads);
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned t = 0; t < threads; t++) {
+		pool.emplace_back(worker<T>, std::cref(generator), count, t + 1, engine, std::ref(totals[t]));
+	}
+	for (auto& thread : pool) {
+		thread.join();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return threads * count / elapsed.count();
+}
+
+
+static int usage(const char* argv0)
+{
+	fprintf(stderr, "Usage: %s [--json] [--seconds S] [--names N] [pattern...]\n", argv0);
+	return 64;
+}
+
+int main(int argc, char **argv)
+{
+	bool json = false;
+	double seconds = 0.2;
+	unsigned long count = 200000;
+	std::vector<std::pair<std::string, std::string>> suite;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--json")) {
+			json = true;
+		} else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+			seconds = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--names") && i + 1 < argc) {
+			count = strtoul(argv[++i], nullptr, 10);
+		} else if (argv[i][0] == '-') {
+			return usage(argv[0]);
+		} else {
+			suite.emplace_back(argv[i], argv[i]);
+		}
+	}
+	if (suite.empty()) {
+		for (auto& p : patterns) {
+			suite.emplace_back(p.name, p.pattern);
+		}
+		for (auto& p : pathological()) {
+			suite.push_back(p);
+		}
+	}
+
+	Report report(json);
+	try {
+		for (auto& p : suite) {
+			compiling(report, p.first, p.second, seconds);
+		}
+	} catch (const std::invalid_argument& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 65;
+	}
+	for (auto& p : suite) {
+		generating(report, p.first, p.second, seconds);
+	}
+
+	NameGen::Generator generator(suite[0].second);
+	NameGen::Program program(generator);
+	for (auto& e : engines) {
+		report.add("engine", e.name)
+		      .add("program/s", scaling(program, 1, count, e.engine))
+		      .row("rng");
+	}
+
+	double tree_base = 0;
+	double program_base = 0;
+	for (unsigned threads = 1; threads <= 64; threads *= 2) {
+		double tree = scaling(generator, threads, count);
+		double compiled = scaling(program, threads, count);
+		if (threads == 1) {
+			tree_base = tree;
+			program_base = compiled;
+		}
+		report.add("threads", threads)
+		      .add("tree/s", tree)
+		      .add("tree_speedup", tree / tree_base)
+		      .add("program/s", compiled)
+		      .add("program_speedup", compiled / program_base)
+		      .row("threads");
+	}
+
+	// Kilobytes on Linux and the BSDs, bytes on macOS
+	struct rusage resources;
+	getrusage(RUSAGE_SELF, &resources);
+	report.add("hardware_threads", std::thread::hardware_concurrency())
+	      .add("peak_rss", resources.ru_maxrss)
+	      .row("process");
+	return 0;
+}
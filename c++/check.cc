@@ -0,0 +1,780 @@
+#include "namegen.h"
+
+#include <locale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <atomic>
+#include <memory_resource>
+#include <new>
+#endif
+
+
+// Checks of what the library promises, run by `make check'. Each one
+// prints what broke and the program exits nonzero if any did.
+static int failures = 0;
+
+static void check(bool ok, const std::string& what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s\n", what.c_str());
+		failures++;
+	}
+}
+
+
+static const char* const patterns[] = {
+	MIDDLE_EARTH,
+	JAPANESE_NAMES_CONSTRAINED,
+	CHINESE_NAMES,
+	GREEK_NAMES,
+	HAWAIIAN_NAMES_2,
+	OLD_LATIN_PLACE_NAMES,
+	DRAGONS_PERN,
+	DRAGON_RIDERS,
+	POKEMON,
+	FANTASY_VOWELS_R,
+	FANTASY_S_A,
+	FANTASY_K_J_Y,
+	"abc",
+	"a(b)(c)d",
+	"(a|(b|c))(d(e)|f)",
+	"(ab)(|c)(|)d",
+	"<s|v>(x|yz)",
+	"ss<s>sss",
+	"(aa|b)(a|c)(a|d)",
+	"!<s>~(abc)",
+};
+
+
+// Check that two samples of names as many, counted in `counts', could
+// come from the same distribution: a two sample chi-square test, with
+// the Wilson-Hilferty bound for p = 0.0001.
+static void similar(const std::map<std::string, std::pair<size_t, size_t>>& counts, const std::string& what)
+{
+	double chi = 0;
+	for (auto& count : counts) {
+		double x = count.second.first, y = count.second.second;
+		chi += (x - y) * (x - y) / (x + y);
+	}
+	double df = counts.size() > 1 ? counts.size() - 1 : 1;
+	double h = 2 / (9 * df);
+	double bound = df * pow(1 - h + 3.719 * sqrt(h), 3);
+	check(chi < bound, what + ": chi-square " + std::to_string(chi) + " over " + std::to_string(bound));
+}
+
+
+// The optimizer may only change how a tree is built: names are numbered
+// the same way and drawn with the same chances either way.
+static void optimizer()
+{
+	for (auto pattern : patterns) {
+		NameGen::Generator plain(pattern, true, false);
+		NameGen::Generator optimized(pattern, true, true);
+		std::string what = std::string("optimizer: ") + pattern;
+		check(plain.combinations() == optimized.combinations(), what + ": combinations");
+		check(plain.overflows() == optimized.overflows(), what + ": overflow");
+		if (plain.overflows() || plain.combinations() != optimized.combinations()) {
+			continue;
+		}
+
+		// Every name when there are few, evenly spaced ones otherwise
+		size_t n = plain.combinations();
+		size_t step = n > 100000 ? n / 100000 : 1;
+		for (size_t i = 0; i < n; i += step) {
+			if (plain.nameAt(i) != optimized.nameAt(i)) {
+				check(false, what + ": name " + std::to_string(i));
+				break;
+			}
+		}
+	}
+
+	// Names from both trees counted and compared with a two sample
+	// chi-square test. The seeds are fixed, so the outcome is too.
+	static const char* const few[] = {
+		"(a|b|c)(|d)",
+		"(a|a|b)(x(y|z)|w)",
+		"<v>(n|m)",
+		"(ab)(c|(d|e|f))g",
+		"!<c>(a|e)",
+	};
+	const size_t draws = 60000;
+	for (auto pattern : few) {
+		NameGen::Generator plain(pattern, true, false);
+		NameGen::Generator optimized(pattern, true, true);
+		NameGen::Rng a(uint64_t(1), 1);
+		NameGen::Rng b(uint64_t(2), 2);
+		std::map<std::string, std::pair<size_t, size_t>> counts;
+		for (size_t i = 0; i < draws; i++) {
+			counts[plain.toString(a)].first++;
+			counts[optimized.toString(b)].second++;
+		}
+		similar(counts, std::string("optimizer: ") + pattern);
+	}
+
+	// Joining a long run of literals takes time linear in its length
+	std::string text;
+	for (size_t i = 0; i < 100000; i++) {
+		text += "xy";
+	}
+	NameGen::Generator literal("(" + text + ")");
+	check(literal.toString() == text, "optimizer: long literal");
+}
+
+
+// A Program draws the names of the tree it came from, and shares its
+// symbols rather than copying them, so it is never the larger of the two
+static void programs()
+{
+	for (auto pattern : patterns) {
+		NameGen::Generator generator(pattern);
+		NameGen::Program program(generator);
+		std::string what = std::string("programs: ") + pattern;
+		NameGen::Rng a(uint64_t(7));
+		NameGen::Rng b(uint64_t(7));
+		bool same = true;
+		for (int i = 0; i < 1000 && same; i++) {
+			same = generator.toString(a) == program.toString(b);
+		}
+		check(same, what + ": names");
+		check(program.memory() < generator.memory(), what + ": memory " +
+		      std::to_string(program.memory()) + " over " + std::to_string(generator.memory()));
+	}
+}
+
+
+// Names are ranked back to the index they were unranked from, or to a
+// smaller one of the same name, and names a pattern cannot produce are
+// not found
+static void ranks()
+{
+	for (auto pattern : patterns) {
+		NameGen::Generator generator(pattern);
+		std::string what = std::string("ranks: ") + pattern;
+		if (generator.overflows()) {
+			continue;
+		}
+		size_t n = generator.combinations();
+		size_t step = n > 2000 ? n / 2000 : 1;
+		for (size_t i = 0; i < n; i += step) {
+			std::string name = generator.nameAt(i);
+			size_t index = generator.indexOf(name);
+			if (index > i || generator.nameAt(index) != name) {
+				check(false, what + ": index " + std::to_string(i));
+				break;
+			}
+		}
+	}
+
+	NameGen::Generator generator(MIDDLE_EARTH);
+	for (auto name : {"", "zzz", "bilgo!", "bilgotu", "Bilbo"}) {
+		check(generator.indexOf(name) == NameGen::Generator::npos, std::string("ranks: ") + name + " not found");
+	}
+}
+
+
+// Enumerating gives every name in index order, and carries on from a
+// position where an earlier enumeration stopped
+static void enumeration()
+{
+	for (auto pattern : {"(a|b|c)(|d)", "<s|v>(x|yz)", "(aa|b)(a|c)(a|d)", "!<v>~(ab|c)", OLD_LATIN_PLACE_NAMES}) {
+		NameGen::Generator generator(pattern);
+		std::string what = std::string("enumeration: ") + pattern;
+		size_t i = 0;
+		size_t stopped = 0;
+		bool same = true;
+		for (auto it = generator.names().begin(); it != generator.names().end(); ++it, i++) {
+			same = same && *it == generator.nameAt(i) && it.position() == i;
+			if (i == generator.combinations() / 3) {
+				stopped = it.position();
+			}
+		}
+		check(same && i == generator.combinations(), what);
+
+		i = stopped;
+		same = true;
+		for (auto& name : generator.names(stopped)) {
+			same = same && name == generator.nameAt(i++);
+		}
+		check(same && i == generator.combinations(), what + ": resumed");
+	}
+}
+
+
+// Groups make their parts only once something is added to them
+static void groups()
+{
+	check(NameGen::Generator("a()<>b").toString() == "ab", "groups: empty");
+	check(NameGen::Generator("()").toString().empty(), "groups: only empty");
+	check(NameGen::Generator("((((x))))").nameAt(0) == "x", "groups: nested");
+	check(NameGen::Generator("(|a)", true, false).combinations() == 2, "groups: empty alternative");
+}
+
+
+// Weighted alternatives are drawn as often as their weights say, by
+// every engine, and a caret that does not end an alternative with a
+// weight is an error
+static void weights()
+{
+	NameGen::Generator plain("(a^3|b)", true, false);
+	NameGen::Generator optimized("(a^3|b)");
+	NameGen::Program program(optimized);
+	static const char* const engines[] = {"tree", "optimized", "program", "direct"};
+	const double draws = 100000;
+	for (size_t engine = 0; engine < 4; engine++) {
+		NameGen::Rng rng(uint64_t(9), engine);
+		double a = 0;
+		for (size_t i = 0; i < draws; i++) {
+			std::string name = engine == 0 ? plain.toString(rng) :
+			                   engine == 1 ? optimized.toString(rng) :
+			                   engine == 2 ? program.toString(rng) : NameGen::generate("(a^3|b)", rng);
+			a += name == "a";
+		}
+		// Against 3:1, with one degree of freedom, p = 0.0001
+		double expected = draws * 3 / 4;
+		double chi = (a - expected) * (a - expected) * (1 / expected + 1 / (draws - expected));
+		check(chi < 15.14, std::string("weights: ") + engines[engine] + ": chi-square " + std::to_string(chi));
+	}
+
+	for (auto pattern : {"(a^|b)", "(a^x|b)", "a^", "(a^3b|c)", "<a^3(x)|b>", "(^_^)"}) {
+		bool thrown = false;
+		try {
+			NameGen::Generator generator(pattern);
+		} catch (const std::invalid_argument&) {
+			thrown = true;
+		}
+		check(thrown, std::string("weights: ") + pattern + " is invalid");
+	}
+}
+
+
+// Names within lengths have the chances they have among the names of
+// those lengths, when collapsing, capitalizing and reversing change
+// their lengths too, and are drawn in a single pass
+static void lengths()
+{
+	static const struct {
+		const char* pattern;
+		size_t minimum;
+		size_t maximum;
+		bool optimize;
+	} ranges[] = {
+		{"(aaa|bb)c", 2, 2, true},
+		{"(aa|b)(a|c)(a|d)", 1, 2, true},
+		{"(aa|b)(a|c)(a|d)", 3, 3, true},
+		{"!(\xc5\xbf" "a|b|\xc3\xa9t)", 2, 2, true},
+		{"~(aa|b)(a|b)a", 1, 3, true},
+		{"!(a|b)(a|bb)b", 2, 3, true},
+		{"~(!(a)a|b)a", 1, 3, true},
+		{"~(\xc3\xa9|e)(\xc3\xa9|e)", 2, 3, true},
+		{"(\xc3\xa9|e)!(\xc3\xa9|\xc5\xbf)", 2, 3, false},
+		{MIDDLE_EARTH, 5, 6, true},
+		{MIDDLE_EARTH, 4, 5, true},
+		{POKEMON, 4, 6, true},
+	};
+	const size_t draws = 20000;
+	for (auto& range : ranges) {
+		std::string what = std::string("lengths: ") + range.pattern;
+		try {
+			NameGen::Generator generator(range.pattern, true, range.optimize);
+			NameGen::Bounded bounded(generator, range.minimum, range.maximum);
+			NameGen::Rng a(uint64_t(1), 1);
+			NameGen::Rng b(uint64_t(2), 2);
+			std::map<std::string, std::pair<size_t, size_t>> counts;
+			for (size_t i = 0; i < draws; i++) {
+				counts[bounded.toString(a)].first++;
+			}
+			// Against names drawn until one fits
+			for (size_t i = 0; i < draws;) {
+				std::string name = generator.toString(b);
+				if (name.size() >= range.minimum && name.size() <= range.maximum) {
+					counts[name].second++;
+					i++;
+				}
+			}
+			similar(counts, what);
+		} catch (const std::invalid_argument& e) {
+			check(false, what + ": " + e.what());
+		}
+	}
+
+	bool thrown = false;
+	try {
+		NameGen::Generator("(aaa|bb)c").toString(9, 9);
+	} catch (const std::invalid_argument&) {
+		thrown = true;
+	}
+	check(thrown, "lengths: none fits");
+
+	// Names that almost never fit come just as fast, however rare
+	try {
+		for (uint32_t seed = 0; seed < 20; seed++) {
+			NameGen::Rng rng(seed);
+			std::string name = NameGen::Generator("<v|(bc)^100000>").toString(1, 1, rng);
+			check(name.size() == 1 && name[0] != 'b', "lengths: rare fit " + name);
+		}
+		NameGen::Generator generator("<v|(bc)^100000><v|(bc)^100000><v|(bc)^100000><v|(bc)^100000>");
+		NameGen::Bounded bounded(generator, 4, 4);
+		for (size_t i = 0; i < 1000; i++) {
+			std::string name = bounded.toString();
+			check(name.size() == 4, "lengths: rarest fit " + name);
+		}
+	} catch (const std::invalid_argument& e) {
+		check(false, std::string("lengths: rare fit: ") + e.what());
+	}
+}
+
+
+// Names straight from the pattern are the names the tree draws with the
+// same Rng, however patterns follow one another, and an invalid pattern
+// throws what the Generator constructor throws
+static void direct()
+{
+	for (size_t i = 0; i < 2000; i++) {
+		const char* pattern = patterns[i * 7 % (sizeof(patterns) / sizeof(*patterns))];
+		NameGen::Rng a(uint64_t(i), 1);
+		NameGen::Rng b(uint64_t(i), 1);
+		if (NameGen::generate(pattern, a) != NameGen::Generator(pattern).toString(b)) {
+			check(false, std::string("direct: ") + pattern);
+			break;
+		}
+	}
+
+	static const char* const invalid[] = {
+		"a)", "(a", "<a)", "(a>", "a^0|b", "a^99999999999|b", "(a^4294967295|b^4294967295)",
+		"(a^|b)", "a^3b", "(a^3(b)|c)",
+		"(a^3000000000|a^3000000000)", "<x|(a^2147483648|b^2147483648)>",
+	};
+	for (auto pattern : invalid) {
+		std::string tree, direct;
+		try {
+			NameGen::Generator generator(pattern);
+		} catch (const std::invalid_argument& e) {
+			tree = e.what();
+		}
+		try {
+			NameGen::generate(pattern);
+		} catch (const std::invalid_argument& e) {
+			direct = e.what();
+		}
+		check(!tree.empty() && tree == direct, std::string("direct: ") + pattern + ": " + direct);
+	}
+
+	// Weights too large apart, but not once folded
+	check(NameGen::generate("(a^2000000000|a|a)") == "a", "direct: folded weights");
+}
+
+
+// Every engine counts its names against the Counter in use, with the
+// allocations that hold them
+static void counter()
+{
+	NameGen::Generator generator(MIDDLE_EARTH);
+	NameGen::Program program(generator);
+	NameGen::Rng rng(uint64_t(1), 1);
+	NameGen::Counter outer;
+	{
+		NameGen::Counter counter;
+		generator.toString(rng);
+		program.toString(rng);
+		NameGen::generate(MIDDLE_EARTH, rng);
+		program.generateBatch(100, rng);
+		auto counts = counter.counts();
+		check(counts.names == 103, "counter: names " + std::to_string(counts.names));
+		check(counts.allocations >= 3 && counts.bytes >= 100, "counter: batch allocations");
+	}
+	NameGen::streamGenerate(program, 100000, 1, [](NameGen::Batch&) {}, 2);
+	check(outer.counts().names == 100103, "counter: streamed names " + std::to_string(outer.counts().names));
+
+	std::string name(100, 'x');
+	check(NameGen::Counter::allocated(name) && !NameGen::Counter::allocated(std::string("x")), "counter: heap strings");
+	check(NameGen::Counter::current() == &outer, "counter: current");
+}
+
+
+// A Program collapses whole names, and whole batches at once, when the
+// pattern collapses triples; names come out the same either way
+static void collapse()
+{
+	check(NameGen::Program(MIDDLE_EARTH).collapses(), "collapse: deferred by default");
+	check(!NameGen::Program(MIDDLE_EARTH, false).collapses(), "collapse: not asked for");
+	for (auto pattern : patterns) {
+		NameGen::Generator generator(pattern);
+		NameGen::Program program(generator);
+		NameGen::Rng a(uint64_t(5), 1);
+		NameGen::Rng b(uint64_t(5), 1);
+		NameGen::Rng c(uint64_t(5), 1);
+		NameGen::Batch batch = program.generateBatch(1000, a);
+		for (size_t i = 0; i < batch.size(); i++) {
+			std::string name = program.toString(b);
+			if (name != batch[i] || name != generator.toString(c)) {
+				check(false, std::string("collapse: ") + pattern);
+				break;
+			}
+		}
+	}
+}
+
+
+// Capitalizing follows Unicode's own uppercase, whatever the locale, in
+// the tree, folded by the optimizer, in a Program and straight from text
+static void capitals()
+{
+	static const struct {
+		const char* pattern;
+		const char* name;
+	} cases[] = {
+		{"!(\xc3\xa9t)", "\xc3\x89t"},                // é
+		{"!(\xe1\xba\xa1)", "\xe1\xba\xa0"},          // ạ
+		{"!(\xc7\x86)", "\xc7\x84"},                  // ǆ
+		{"!(\xc2\xb5)", "\xce\x9c"},                  // µ
+		{"!(\xf0\x90\x90\xa8)", "\xf0\x90\x90\x80"},  // Deseret
+		{"!(\xc3\x9f)", "\xc3\x9f"},                  // ß has none
+		{"!(\xe4\xb8\xad)", "\xe4\xb8\xad"},          // nor has 中
+	};
+	for (const char* locale : {"C", "C.UTF-8"}) {
+		setlocale(LC_CTYPE, locale);
+		for (auto& c : cases) {
+			std::string what = std::string("capitals: ") + c.pattern + " in " + locale;
+			NameGen::Rng rng;
+			check(NameGen::Generator(c.pattern, true, false).toString(rng) == c.name, what);
+			check(NameGen::Generator(c.pattern).toString(rng) == c.name, what + ", optimized");
+			check(NameGen::Program(c.pattern).toString(rng) == c.name, what + ", compiled");
+			check(NameGen::generate(c.pattern, rng) == c.name, what + ", direct");
+		}
+	}
+	setlocale(LC_CTYPE, "C");
+}
+
+
+// Names generated in bulk are the same whatever the number of threads
+static void threads()
+{
+	NameGen::Program program(MIDDLE_EARTH);
+	const size_t count = 200000;  // not a whole number of chunks
+	auto one = NameGen::bulkGenerate(program, count, 42, 1);
+	auto four = NameGen::bulkGenerate(program, count, 42, 4);
+	bool same = one.size() == four.size();
+	size_t names = 0;
+	for (size_t i = 0; same && i < one.size(); i++) {
+		same = one[i].arena == four[i].arena && one[i].offsets == four[i].offsets;
+		names += one[i].size();
+	}
+	check(same && names == count, "threads: 1 and 4 threads");
+}
+
+
+// A Batch is sized for names of the mean length rather than the longest,
+// so that a long and rare alternative does not reserve room in all
+static void batches()
+{
+	check(NameGen::Generator("(a|bc)").mean() == 1.5, "batches: mean");
+	std::string text;
+	for (size_t i = 0; i < 5000; i++) {
+		text += "xy";
+	}
+	std::string pattern = "(a^999|" + text + ")";
+	for (bool optimize : {false, true}) {
+		NameGen::Generator generator(pattern, true, optimize);
+		check(generator.mean() == (999 + 10000) / 1000.0, "batches: weighted mean");
+		NameGen::Rng rng(uint64_t(1), 1);
+		NameGen::Batch batch = generator.generateBatch(65536, rng);
+		check(batch.arena.capacity() < 4 << 20, "batches: reserved " + std::to_string(batch.arena.capacity()));
+		batch = NameGen::Program(generator).generateBatch(65536, rng);
+		check(batch.arena.capacity() < 4 << 20, "batches: program reserved " + std::to_string(batch.arena.capacity()));
+	}
+}
+
+
+// Unique names are distinct, however many of the names are asked for,
+// and asking for more than there are throws
+static void unique()
+{
+	static const struct {
+		const char* pattern;
+		size_t n;
+	} cases[] = {
+		{MIDDLE_EARTH, 1000},
+		{"(a|<s>)", 10},
+		{"(a|<s>)", 59},
+		{"(a|<s>)", 116},
+		{"<v|V>", 22},
+		{"(aa|b)(a|c)(a|d)", 6},
+	};
+	for (auto& c : cases) {
+		std::string what = std::string("unique: ") + c.pattern + ", " + std::to_string(c.n);
+		NameGen::Rng rng(uint64_t(3), 1);
+		NameGen::Batch batch = NameGen::Generator(c.pattern).generateUnique(c.n, rng);
+		std::set<std::string> names;
+		for (size_t i = 0; i < batch.size(); i++) {
+			names.insert(batch[i]);
+		}
+		check(batch.size() == c.n && names.size() == c.n, what);
+	}
+
+	static const struct {
+		const char* pattern;
+		size_t n;
+	} over[] = {
+		{"(a|<s>)", 117},    // more than combinations()
+		{"(aa|aaa)", 2},     // collapsed into one name
+		{"<v|V>", 23},       // 28 combinations, of 22 names
+	};
+	for (auto& c : over) {
+		bool thrown = false;
+		try {
+			NameGen::Generator(c.pattern).generateUnique(c.n);
+		} catch (const std::invalid_argument&) {
+			thrown = true;
+		}
+		check(thrown, std::string("unique: ") + c.pattern + ", " + std::to_string(c.n) + " throws");
+	}
+}
+
+
+// Names written into a caller's buffer are cut short to fit it, always
+// ending in a NUL, and the length of the whole name is returned
+static void buffers()
+{
+	NameGen::Generator generator("(abcdefgh)");
+	NameGen::Program program(generator);
+	NameGen::Rng rng;
+	for (size_t len : {0, 1, 4, 8, 9, 16}) {
+		char tree[17], code[17];
+		memset(tree, '#', sizeof(tree));
+		memset(code, '#', sizeof(code));
+		size_t a = generator.generate(tree, len, rng);
+		size_t b = program.generate(code, len, rng);
+		std::string what = "buffers: " + std::to_string(len) + " bytes";
+		check(a == 8 && b == 8, what + ": length");
+		size_t n = len ? std::min<size_t>(len - 1, 8) : 0;
+		for (const char* dst : {tree, code}) {
+			check(!len || (std::string(dst) == std::string("abcdefgh", n)), what + ": truncated");
+			check(dst[len ? n + 1 : 0] == '#', what + ": written past the name");
+		}
+	}
+}
+
+
+// A Cache stays within its budget, keeps what it has just compiled, and
+// hands out the same generator for as long as it keeps it
+static void cache()
+{
+	size_t size = NameGen::Generator(MIDDLE_EARTH).memory();
+	NameGen::Cache cache(3 * size);
+	bool within = true;
+	bool kept = true;
+	for (auto pattern : patterns) {
+		auto generator = cache.get(pattern);
+		within = within && cache.stats().memory <= 3 * size;
+		kept = kept && cache.get(pattern) == generator;
+	}
+	check(within, "cache: over budget");
+	check(kept, "cache: evicted what it just compiled");
+	auto stats = cache.stats();
+	check(stats.evictions > 0 && stats.hits == sizeof(patterns) / sizeof(*patterns), "cache: evictions and hits");
+
+	NameGen::Cache small(size / 2);
+	check(small.get(MIDDLE_EARTH) && small.get("abc"), "cache: larger than the budget");
+	stats = small.stats();
+	check(stats.entries == 1 && stats.memory <= size / 2, "cache: larger than the budget kept");
+}
+
+
+// A std::mt19937 Rng runs as the standard engine does, and copies of
+// every Rng carry on from where the original was
+static void rng()
+{
+	NameGen::Rng twister(uint32_t(5489), NameGen::Rng::mt19937);
+	std::mt19937 standard(5489);
+	bool same = true;
+	for (int i = 0; i < 1000; i++) {
+		same = same && twister.next() == standard();
+	}
+	check(same, "rng: mt19937 as the standard");
+
+	// PCG32 as pcg32_srandom_r(&rng, 42, 54) starts in the reference
+	// pcg32-demo, and the others from states made by SplitMix64 as
+	// Rng::seed() makes them, worked out apart from this library
+	static const struct {
+		NameGen::Rng::engines_t engine;
+		uint64_t seed;
+		uint64_t stream;
+		uint32_t outputs[4];
+	} answers[] = {
+		{NameGen::Rng::pcg32, 42, 54, {0xa15c02b7, 0x7b47f409, 0xba1d3330, 0x83d2f293}},
+		{NameGen::Rng::xoshiro256, 1, 2, {0x5f147c97, 0x3beb7d2d, 0x2263ee6c, 0x27bc9820}},
+		{NameGen::Rng::wyrand, 1, 2, {0xc72a773e, 0x781a8914, 0x9b227f61, 0x4c5ef396}},
+	};
+	for (auto& answer : answers) {
+		NameGen::Rng rng(answer.seed, answer.stream, answer.engine);
+		same = true;
+		for (uint32_t output : answer.outputs) {
+			same = same && rng.next() == output;
+		}
+		check(same, "rng: known answers of engine " + std::to_string(answer.engine));
+	}
+
+	for (auto engine : {NameGen::Rng::xoshiro256, NameGen::Rng::pcg32,
+	                    NameGen::Rng::wyrand, NameGen::Rng::mt19937}) {
+		NameGen::Rng original(uint64_t(7), 3, engine);
+		original.next();
+		NameGen::Rng copy(original);
+		NameGen::Rng assigned;
+		assigned = original;
+		same = true;
+		for (int i = 0; i < 1000; i++) {
+			uint32_t x = original.next();
+			same = same && copy.next() == x && assigned.next() == x;
+		}
+		check(same, "rng: copies of engine " + std::to_string(engine));
+	}
+}
+
+
+#if __cplusplus >= 202002L
+
+// A pattern compiled while building draws the names a Program compiled
+// from it at run time draws, from the same Rng
+template <NameGen::Static::Pattern pattern, bool collapse_triples=true>
+static void compiled()
+{
+	NameGen::StaticGenerator<pattern, collapse_triples> generator;
+	NameGen::Program program(pattern.text, collapse_triples);
+	for (uint64_t seed = 0; seed < 4; seed++) {
+		NameGen::Rng a(seed, 1);
+		NameGen::Rng b(seed, 1);
+		for (size_t i = 0; i < 1000; i++) {
+			if (generator.toString(a) != program.toString(b)) {
+				check(false, std::string("statics: ") + pattern.text + (collapse_triples ? "" : ", not collapsed"));
+				return;
+			}
+		}
+	}
+}
+
+static void statics()
+{
+	compiled<MIDDLE_EARTH>();
+	compiled<JAPANESE_NAMES_CONSTRAINED>();
+	compiled<JAPANESE_NAMES_DIVERSE>();
+	compiled<CHINESE_NAMES>();
+	compiled<GREEK_NAMES>();
+	compiled<HAWAIIAN_NAMES_1>();
+	compiled<HAWAIIAN_NAMES_2>();
+	compiled<OLD_LATIN_PLACE_NAMES>();
+	compiled<DRAGONS_PERN>();
+	compiled<DRAGON_RIDERS>();
+	compiled<POKEMON>();
+	compiled<FANTASY_VOWELS_R>();
+	compiled<FANTASY_S_A>();
+	compiled<FANTASY_H_L>();
+	compiled<FANTASY_N_L>();
+	compiled<FANTASY_K_N>();
+	compiled<FANTASY_J_G_Z>();
+	compiled<FANTASY_K_J_Y>();
+	compiled<FANTASY_S_E>();
+	compiled<MIDDLE_EARTH, false>();
+	compiled<"!s~(xyz)<v|>(aaa^3|bb)">();
+	compiled<"!s~(xyz)<v|>(aaa^3|bb)", false>();
+}
+
+#endif
+
+
+#if __cplusplus >= 201703L
+
+// Every use of the global allocator, counted for pmr() to see that
+// generating into a memory_resource stays off it. Kept out of line, or
+// GCC takes a malloc() inlined here and freed by the library for a
+// mismatch.
+static std::atomic<size_t> news(0);
+
+__attribute__((noinline)) void* operator new(size_t bytes)
+{
+	news++;
+	if (void* p = malloc(bytes ? bytes : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+// Names generated into a monotonic_buffer_resource take their memory
+// from it alone, once the scratch string each thread keeps has grown
+static void pmr()
+{
+	std::vector<char> buffer(1 << 20);
+	std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+	NameGen::Program program("sV'isV'i", true, NameGen::allocator(&arena));
+	NameGen::Program longer("(" + std::string(256, 'x') + ")");
+	NameGen::Rng rng(uint64_t(3));
+	NameGen::toString(longer, rng, &arena);
+	NameGen::toString(program, rng, &arena);
+
+	size_t before = news, total = 0;
+	for (size_t i = 0; i < 10000; i++) {
+		total += NameGen::toString(program, rng, &arena).size();
+	}
+	size_t used = news - before;
+	check(used == 0, "pmr: global allocator used " + std::to_string(used) + " times");
+	check(total > 10000 * 15, "pmr: names too short to leave the string");
+}
+
+#endif
+
+
+int main()
+{
+	try {
+		optimizer();
+		groups();
+		programs();
+		weights();
+		ranks();
+		enumeration();
+		lengths();
+		direct();
+		collapse();
+		capitals();
+		threads();
+		batches();
+		unique();
+		buffers();
+		cache();
+#if __cplusplus >= 202002L
+		statics();
+#endif
+#if __cplusplus >= 201703L
+		pmr();
+#endif
+		rng();
+		counter();
+	} catch (const std::exception& e) {
+		check(false, std::string("exception: ") + e.what());
+	}
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
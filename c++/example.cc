@@ -1,33 +1,305 @@
 #include "namegen.h"
 
+#include <errno.h>
 #include <stdio.h>
-#include <clocale>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <random>
+
+
+// Output gathered into large blocks and written with write(2), since
+// formatting names one at a time through iostreams is far slower than
+// generating them.
+class Output
+{
+	static const size_t block = 1 << 20;
+
+	std::string buffer;
+	char delimiter;
+	bool json;
+
+	void write(const char* data, size_t n)
+	{
+		while (n) {
+			ssize_t written = ::write(1, data, n);
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::runtime_error(std::string("write: ") + strerror(errno));
+			}
+			data += written;
+			n -= written;
+		}
+	}
+
+	// Length of the well-formed UTF-8 sequence that `s' starts with, of
+	// at most `n' bytes, or 0 if there is none.
+	static size_t sequence(const unsigned char* s, size_t n)
+	{
+		size_t length;
+		unsigned char low = 0x80, high = 0xbf;
+		if (s[0] < 0x80) {
+			return 1;
+		} else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+			length = 2;
+		} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+			// Neither overlong nor a surrogate
+			length = 3;
+			low = s[0] == 0xe0 ? 0xa0 : 0x80;
+			high = s[0] == 0xed ? 0x9f : 0xbf;
+		} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+			// Neither overlong nor past U+10FFFF
+			length = 4;
+			low = s[0] == 0xf0 ? 0x90 : 0x80;
+			high = s[0] == 0xf4 ? 0x8f : 0xbf;
+		} else {
+			return 0;
+		}
+		if (n < length || s[1] < low || s[1] > high) {
+			return 0;
+		}
+		for (size_t i = 2; i < length; i++) {
+			if ((s[i] & 0xc0) != 0x80) {
+				return 0;
+			}
+		}
+		return length;
+	}
+
+	// `s' as a JSON string. Bytes that are not part of well-formed UTF-8,
+	// which a pattern given in another encoding can produce, become
+	// U+FFFD, so that the output is always valid JSON.
+	void quote(const char* s, size_t n)
+	{
+		static const char hex[] = "0123456789abcdef";
+		const unsigned char* u = reinterpret_cast<const unsigned char*>(s);
+		buffer += '"';
+		for (size_t i = 0; i < n; i++) {
+			unsigned char c = u[i];
+			if (c == '"' || c == '\\') {
+				buffer += '\\';
+				buffer += c;
+			} else if (c < 0x20) {
+				buffer += "\\u00";
+				buffer += hex[c >> 4];
+				buffer += hex[c & 15];
+			} else if (size_t length = sequence(u + i, n - i)) {
+				buffer.append(s + i, length);
+				i += length - 1;
+			} else {
+				buffer += "\\ufffd";
+			}
+		}
+		buffer += '"';
+	}
+
+public:
+	std::string pattern;
+
+	Output(char delimiter_, bool json_) :
+		delimiter(delimiter_),
+		json(json_)
+	{
+		buffer.reserve(block + 4096);
+	}
+
+	~Output()
+	{
+		try {
+			flush();
+		} catch (...) {
+		}
+	}
+
+	void flush()
+	{
+		write(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+
+	void name(const char* s, size_t n)
+	{
+		if (json) {
+			buffer += "{\"pattern\":";
+			quote(pattern.data(), pattern.size());
+			buffer += ",\"name\":";
+			quote(s, n);
+			buffer += "}\n";
+		} else {
+			buffer.append(s, n);
+			buffer += delimiter;
+		}
+		if (buffer.size() >= block) {
+			flush();
+		}
+	}
+
+	void names(NameGen::Batch& chunk)
+	{
+		if (json) {
+			for (size_t i = 0; i < chunk.size(); i++) {
+				name(chunk[i], chunk.length(i));
+			}
+			return;
+		}
+		// The chunk already holds its names back to back, each followed
+		// by a NUL, so it only needs its delimiters swapped to be written
+		// as it is
+		if (delimiter) {
+			for (auto& c : chunk.arena) {
+				if (!c) {
+					c = delimiter;
+				}
+			}
+		}
+		flush();
+		write(chunk.arena.data(), chunk.arena.size());
+	}
+};
+
+
+static bool number(const char* s, unsigned long long& value)
+{
+	char* end;
+	if (!*s || *s == '-') {
+		return false;
+	}
+	errno = 0;
+	value = strtoull(s, &end, 10);
+	return !*end && errno != ERANGE;
+}
 
 
 int main(int argc, char **argv)
 {
-	int num = 1;
-	std::setlocale(LC_CTYPE, "");
-	if (argc < 2 || argc > 3 || (argc == 3 && (num = atoi(argv[2])) && num == -1)) {
-		std::cerr << "Usage: " << argv[0] << " <pattern> [num]\n";
-		std::cerr << "  pattern - Template for names to generate.\n";
-		std::cerr << "  num     - Number of names to generate.\n";
+	const char* program = argv[0];
+	unsigned long long num = 1;
+	unsigned long long seed = 0;
+	unsigned long long threads = 0;
+	bool seeded = false;
+	bool all = false;
+	bool json = false;
+	char delimiter = '\n';
+	const char* file = nullptr;
+	std::vector<std::string> patterns;
+
+	// Options may come anywhere, before or after the pattern and number,
+	// up to a `--' after which everything is taken as it is
+	bool usage = false;
+	bool options = true;
+	std::vector<const char*> positionals;
+	for (int i = 1; i < argc && !usage; i++) {
+		std::string arg = argv[i];
+		bool more = i + 1 < argc;
+		if (!options || arg.size() < 2 || arg[0] != '-') {
+			positionals.push_back(argv[i]);
+		} else if (arg == "--") {
+			options = false;
+		} else if (arg == "-a") {
+			all = true;
+		} else if (arg == "-0" || arg == "--null") {
+			delimiter = '\0';
+		} else if (arg == "-j" || arg == "--json") {
+			json = true;
+		} else if ((arg == "-s" || arg == "--seed") && more) {
+			usage = !number(argv[++i], seed);
+			seeded = true;
+		} else if ((arg == "-t" || arg == "--threads") && more) {
+			usage = !number(argv[++i], threads) || threads > 4096;
+		} else if ((arg == "-f" || arg == "--file") && more) {
+			file = argv[++i];
+		} else {
+			usage = true;
+		}
+	}
+	size_t count = positionals.size();
+	if (!file && count > 0) {
+		patterns.push_back(positionals[0]);
+	}
+	if (count > (file ? 0 : 1)) {
+		usage = usage || !number(positionals.back(), num);
+	}
+	usage = usage || count > (file ? 1 : 2);
+	if (usage || (patterns.empty() && !file)) {
+		std::cerr << "Usage: " << program << " [options] [--] <pattern> [num]\n";
+		std::cerr << "       " << program << " [options] -f <file> [--] [num]\n";
+		std::cerr << "  -a              - List every name the pattern can produce.\n";
+		std::cerr << "  -0, --null      - End names with NUL rather than newline.\n";
+		std::cerr << "  -j, --json      - Write JSON lines of pattern and name, with bytes\n";
+		std::cerr << "                    that are not UTF-8 as U+FFFD.\n";
+		std::cerr << "  -s, --seed n    - Seed, for the same names on every run.\n";
+		std::cerr << "  -t, --threads n - Threads to generate on (0 for one per core).\n";
+		std::cerr << "  -f, --file f    - Read patterns from `f', one per line (- for stdin).\n";
+		std::cerr << "  --              - End options, so a pattern may start with `-'.\n";
+		std::cerr << "  pattern         - Template for names to generate.\n";
+		std::cerr << "  num             - Number of names to generate for each pattern.\n";
 		return 64;
 	}
 
-	char * pattern = argv[1];
-	// std::cerr << "> pattern = " << pattern << "\n";
+	if (file) {
+		std::ifstream in;
+		if (strcmp(file, "-")) {
+			in.open(file);
+			if (!in) {
+				std::cerr << program << ": " << file << ": " << strerror(errno) << "\n";
+				return 66;
+			}
+		}
+		std::istream& lines = strcmp(file, "-") ? in : std::cin;
+		for (std::string line; std::getline(lines, line);) {
+			// Files written on Windows end their lines in CRLF
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (!line.empty()) {
+				patterns.push_back(line);
+			}
+		}
+	}
+	if (!seeded) {
+		seed = (uint64_t(std::random_device()()) << 32) ^ std::random_device()();
+	}
 
-	NameGen::Generator generator(pattern);
+	auto start = std::chrono::steady_clock::now();
+	unsigned long long total = 0;
+	Output out(delimiter, json);
+	try {
+		for (size_t k = 0; k < patterns.size(); k++) {
+			NameGen::Generator generator(patterns[k]);
+			out.pattern = patterns[k];
+			if (patterns.size() == 1) {
+				std::cerr << "> combinations = " << generator.combinations()
+				          << (generator.overflows() ? " (overflow)" : "") << "\n";
+			}
 
-	std::cerr << "> combinations = " << generator.combinations() << "\n";
-	// std::cerr << "> min = " << generator.min() << "\n";
-	// std::cerr << "> max = " << generator.max() << "\n";
+			if (all) {
+				for (auto& name : generator.names()) {
+					out.name(name.data(), name.size());
+					total++;
+				}
+				continue;
+			}
 
-	for (int i = 0; i < num; i++) {
-		std::cout << generator.toString() << "\n";
+			// Each pattern of a file draws from a seed of its own
+			NameGen::streamGenerate(NameGen::Program(generator), num, seed + k,
+			                        [&](NameGen::Batch& chunk) { out.names(chunk); }, threads);
+			total += num;
+		}
+		out.flush();
+	} catch (const std::invalid_argument& e) {
+		std::cerr << program << ": " << e.what() << "\n";
+		return 65;
+	} catch (const std::exception& e) {
+		std::cerr << program << ": " << e.what() << "\n";
+		return 74;
 	}
 
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fprintf(stderr, "> %llu names in %.3f s, %.0f names/s\n", total, seconds, seconds > 0 ? total / seconds : 0.0);
 	return 0;
 }
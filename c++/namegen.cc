@@ -10,490 +10,4346 @@
 #include "namegen.h"
 
 #include <algorithm>  // for move, reverse
+#include <atomic>     // for atomic
 #include <chrono>     // for rng seed
+#include <condition_variable>  // for condition_variable
+#include <cstring>    // for memcmp
+#include <exception>  // for exception_ptr
 #include <cwchar>     // for size_t, mbsrtowcs, wcsrtombs
-#include <cwctype>    // for towupper
+#include <deque>      // for deque
 #include <memory>     // for make_unique
-#include <random>     // for mt19937, uniform_real_distribution
+#include <random>     // for mt19937
 #include <stdexcept>  // for invalid_argument, out_of_range
+#include <thread>     // for thread
+#include <typeinfo>   // for typeid
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>  // for _mm_cmpeq_epi8, _mm256_cmpeq_epi8
+#endif
 
 
 using namespace NameGen;
 
 
-static std::mt19937 rng(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+Batch::Batch() :
+	offsets(1, 0)
+{
+}
 
+size_t Batch::size() const
+{
+	return offsets.size() - 1;
+}
 
-// https://isocpp.org/wiki/faq/ctors#static-init-order
-// Avoid the "static initialization order fiasco"
-const std::unordered_map<std::string, const std::vector<std::string>>& Generator::SymbolMap()
+size_t Batch::length(size_t i) const
 {
-	static auto* const symbols = new std::unordered_map<std::string, const std::vector<std::string>>({
-		{
-			"s", {
-				"ach", "ack", "ad", "age", "ald", "ale", "an", "ang", "ar", "ard",
-				"as", "ash", "at", "ath", "augh", "aw", "ban", "bel", "bur", "cer",
-				"cha", "che", "dan", "dar", "del", "den", "dra", "dyn", "ech", "eld",
-				"elm", "em", "en", "end", "eng", "enth", "er", "ess", "est", "et",
-				"gar", "gha", "hat", "hin", "hon", "ia", "ight", "ild", "im", "ina",
-				"ine", "ing", "ir", "is", "iss", "it", "kal", "kel", "kim", "kin",
-				"ler", "lor", "lye", "mor", "mos", "nal", "ny", "nys", "old", "om",
-				"on", "or", "orm", "os", "ough", "per", "pol", "qua", "que", "rad",
-				"rak", "ran", "ray", "ril", "ris", "rod", "roth", "ryn", "sam",
-				"say", "ser", "shy", "skel", "sul", "tai", "tan", "tas", "ther",
-				"tia", "tin", "ton", "tor", "tur", "um", "und", "unt", "urn", "usk",
-				"ust", "ver", "ves", "vor", "war", "wor", "yer"
-			}
-		},
-		{
-			"v", {
-				"a", "e", "i", "o", "u", "y"
-			}
-		},
-		{
-			"V", {
-				"a", "e", "i", "o", "u", "y", "ae", "ai", "au", "ay", "ea", "ee",
-				"ei", "eu", "ey", "ia", "ie", "oe", "oi", "oo", "ou", "ui"
-			}
-		},
-		{
-			"c", {
-				"b", "c", "d", "f", "g", "h", "j", "k", "l", "m", "n", "p", "q", "r",
-				"s", "t", "v", "w", "x", "y", "z"
-			}
-		},
-		{
-			"B", {
-				"b", "bl", "br", "c", "ch", "chr", "cl", "cr", "d", "dr", "f", "g",
-				"h", "j", "k", "l", "ll", "m", "n", "p", "ph", "qu", "r", "rh", "s",
-				"sch", "sh", "sl", "sm", "sn", "st", "str", "sw", "t", "th", "thr",
-				"tr", "v", "w", "wh", "y", "z", "zh"
-			}
-		},
-		{
-			"C", {
-				"b", "c", "ch", "ck", "d", "f", "g", "gh", "h", "k", "l", "ld", "ll",
-				"lt", "m", "n", "nd", "nn", "nt", "p", "ph", "q", "r", "rd", "rr",
-				"rt", "s", "sh", "ss", "st", "t", "th", "v", "w", "y", "z"
-			}
-		},
-		{
-			"i", {
-				"air", "ankle", "ball", "beef", "bone", "bum", "bumble", "bump",
-				"cheese", "clod", "clot", "clown", "corn", "dip", "dolt", "doof",
-				"dork", "dumb", "face", "finger", "foot", "fumble", "goof",
-				"grumble", "head", "knock", "knocker", "knuckle", "loaf", "lump",
-				"lunk", "meat", "muck", "munch", "nit", "numb", "pin", "puff",
-				"skull", "snark", "sneeze", "thimble", "twerp", "twit", "wad",
-				"wimp", "wipe"
-			}
-		},
-		{
-			"m", {
-				"baby", "booble", "bunker", "cuddle", "cuddly", "cutie", "doodle",
-				"foofie", "gooble", "honey", "kissie", "lover", "lovey", "moofie",
-				"mooglie", "moopie", "moopsie", "nookum", "poochie", "poof",
-				"poofie", "pookie", "schmoopie", "schnoogle", "schnookie",
-				"schnookum", "smooch", "smoochie", "smoosh", "snoogle", "snoogy",
-				"snookie", "snookum", "snuggy", "sweetie", "woogle", "woogy",
-				"wookie", "wookum", "wuddle", "wuddly", "wuggy", "wunny"
-			}
-		},
-		{
-			"M", {
-				"boo", "bunch", "bunny", "cake", "cakes", "cute", "darling",
-				"dumpling", "dumplings", "face", "foof", "goo", "head", "kin",
-				"kins", "lips", "love", "mush", "pie", "poo", "pooh", "pook", "pums"
-			}
-		},
-		{
-			"D", {
-				"b", "bl", "br", "cl", "d", "f", "fl", "fr", "g", "gh", "gl", "gr",
-				"h", "j", "k", "kl", "m", "n", "p", "th", "w"
-			}
-		},
-		{
-			"d", {
-				"elch", "idiot", "ob", "og", "ok", "olph", "olt", "omph", "ong",
-				"onk", "oo", "oob", "oof", "oog", "ook", "ooz", "org", "ork", "orm",
-				"oron", "ub", "uck", "ug", "ulf", "ult", "um", "umb", "ump", "umph",
-				"un", "unb", "ung", "unk", "unph", "unt", "uzz"
-			}
-		}
-	});
+	return offsets[i + 1] - offsets[i] - 1;
+}
 
-	return *symbols;
+const char* Batch::operator[](size_t i) const
+{
+	return arena.data() + offsets[i];
 }
 
 
-#ifdef HAVE_CXX14
-using std::make_unique;
-#else
-// make_unique is not available in c++11, so we use this template function
-// to maintain full c++11 compatibility; std::make_unique is part of C++14.
-template<typename T, typename... Args>
-std::unique_ptr<T> make_unique(Args&&... args)
+// The Counter names count against on this thread
+static thread_local Counter* counting = nullptr;
+
+Counter::Use::Use(Counter* counter) :
+	outer(counting)
 {
-    return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
+	counting = counter;
 }
-#endif
 
+Counter::Use::~Use()
+{
+	counting = outer;
+}
 
-Generator::Generator()
+Counter::Counter() :
+	outer(counting),
+	names(0),
+	allocations(0),
+	bytes(0)
 {
+	counting = this;
 }
 
+Counter::~Counter()
+{
+	counting = outer;
+}
 
-Generator::Generator(std::vector<std::unique_ptr<Generator>>&& generators_) :
-	generators(std::move(generators_))
+Counter::Counts Counter::counts() const
 {
+	return Counts{names, allocations, bytes};
 }
 
+Counter* Counter::current()
+{
+	return counting;
+}
 
-size_t Generator::combinations()
+void Counter::count(size_t names_, size_t allocations_, size_t bytes_)
 {
-	size_t total = 1;
-	for (auto& g : generators) {
-		total *= g->combinations();
+	for (Counter* c = counting; c; c = c->outer) {
+		c->names.fetch_add(names_, std::memory_order_relaxed);
+		c->allocations.fetch_add(allocations_, std::memory_order_relaxed);
+		c->bytes.fetch_add(bytes_, std::memory_order_relaxed);
 	}
-	return total;
 }
 
 
-size_t Generator::min()
+// A name made by `make' in `scratch', a buffer kept per thread, and
+// returned in a string of its own: at most one allocation, of the
+// name's exact size, however often the buffer would have grown.
+template <typename F>
+static std::string returned(std::string& scratch, F make)
 {
-	size_t final = 0;
-	for (auto& g : generators) {
-		final += g->min();
-	}
-	return final;
+	const void* data = scratch.data();
+	scratch.clear();
+	make(scratch);
+	Counter::grown(scratch, data);
+	std::string name(scratch);
+	Counter::returned(name);
+	return name;
 }
 
+// A name made by `make' in `scratch' for copying to a caller's buffer.
+template <typename F>
+static void copied(std::string& scratch, F make)
+{
+	const void* data = scratch.data();
+	scratch.clear();
+	make(scratch);
+	Counter::grown(scratch, data);
+	Counter::count(1, 0, 0);
+}
 
-size_t Generator::max()
+
+// Rounds of SplitMix64, to spread seeds over engine states
+static uint64_t splitmix64(uint64_t& x)
 {
-	size_t final = 0;
-	for (auto& g : generators) {
-		final += g->max();
-	}
-	return final;
+	uint64_t z = (x += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
 }
 
+static inline uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
 
-std::string Generator::toString() {
-	std::string str;
-	for (auto& g : generators) {
-		str.append(g->toString());
-	}
-	return str;
+// Full 128-bit product of a and b.
+static inline void multiply(uint64_t a, uint64_t b, uint64_t& hi, uint64_t& lo)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = (unsigned __int128)a * b;
+	hi = r >> 64;
+	lo = r;
+#else
+	uint64_t ll = (a & 0xffffffff) * (b & 0xffffffff);
+	uint64_t lh = (a & 0xffffffff) * (b >> 32);
+	uint64_t hl = (a >> 32) * (b & 0xffffffff);
+	uint64_t hh = (a >> 32) * (b >> 32);
+	uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+	hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+	lo = (mid << 32) | (ll & 0xffffffff);
+#endif
 }
 
+// A std::mt19937 copied from `from', if there is one to copy
+static std::unique_ptr<std::mt19937> copy(const std::mt19937* from)
+{
+	return std::unique_ptr<std::mt19937>(from ? new std::mt19937(*from) : nullptr);
+}
 
-void Generator::add(std::unique_ptr<Generator>&& g)
+// The state of a std::mt19937, if that is the engine
+static std::unique_ptr<std::mt19937> twist(Rng::engines_t engine)
 {
-	generators.push_back(std::move(g));
+	return std::unique_ptr<std::mt19937>(engine == Rng::mt19937 ? new std::mt19937 : nullptr);
 }
 
+Rng::Rng(engines_t engine_) :
+	engine(engine_),
+	twister(twist(engine_))
+{
+	// The address tells apart the Rngs of threads started together
+	seed(std::chrono::high_resolution_clock::now().time_since_epoch().count(),
+	     reinterpret_cast<uintptr_t>(this));
+}
 
-Random::Random()
+Rng::Rng(uint32_t seed_, engines_t engine_) :
+	engine(engine_),
+	twister(twist(engine_))
 {
+	seed(seed_);
 }
 
-Random::Random(std::vector<std::unique_ptr<Generator>>&& generators_) :
-	Generator(std::move(generators_))
+Rng::Rng(uint64_t seed_, uint64_t stream, engines_t engine_) :
+	engine(engine_),
+	twister(twist(engine_))
 {
+	seed(seed_, stream);
 }
 
-size_t Random::combinations()
+Rng::Rng(const Rng& other) :
+	engine(other.engine),
+	twister(copy(other.twister.get()))
 {
-	size_t total = 0;
-	for (auto& g : generators) {
-		total += g->combinations();
+	std::copy(other.state, other.state + 4, state);
+}
+
+Rng& Rng::operator=(const Rng& other)
+{
+	if (this != &other) {
+		engine = other.engine;
+		std::copy(other.state, other.state + 4, state);
+		twister = copy(other.twister.get());
 	}
-	return total ? total : 1;
+	return *this;
 }
 
-size_t Random::min()
+// A std::mt19937 is seeded as the standard seeds it, others as stream 0.
+void Rng::seed(uint32_t seed_)
 {
-	size_t final = -1;
-	for (auto& g : generators) {
-		size_t current = g->min();
-		if (current < final) {
-			final = current;
+	if (engine == mt19937) {
+		twister->seed(seed_);
+	} else {
+		seed(seed_, 0);
+	}
+}
+
+void Rng::seed(uint64_t seed_, uint64_t stream)
+{
+	uint64_t x = stream;
+	x = seed_ ^ splitmix64(x);
+	switch (engine) {
+		case xoshiro256:
+			for (auto& word : state) {
+				word = splitmix64(x);
+			}
+			break;
+		case pcg32:
+			// As pcg32_srandom_r() does, with the stream as sequence
+			state[0] = 0;
+			state[1] = (stream << 1) | 1;
+			next();
+			state[0] += seed_;
+			next();
+			break;
+		case wyrand:
+			state[0] = splitmix64(x);
+			break;
+		case mt19937: {
+			std::seed_seq seq{
+				uint32_t(seed_), uint32_t(seed_ >> 32),
+				uint32_t(stream), uint32_t(stream >> 32)
+			};
+			twister->seed(seq);
+			break;
 		}
 	}
-	return final;
 }
 
-size_t Random::max()
+uint32_t Rng::next()
 {
-	size_t final = 0;
-	for (auto& g : generators) {
-		size_t current = g->max();
-		if (current > final) {
-			final = current;
+	switch (engine) {
+		case xoshiro256: {
+			uint64_t result = rotl(state[1] * 5, 7) * 9;
+			uint64_t t = state[1] << 17;
+			state[2] ^= state[0];
+			state[3] ^= state[1];
+			state[1] ^= state[2];
+			state[0] ^= state[3];
+			state[2] ^= t;
+			state[3] = rotl(state[3], 45);
+			return result >> 32;
+		}
+		case pcg32: {
+			uint64_t old = state[0];
+			state[0] = old * 6364136223846793005ULL + state[1];
+			uint32_t shifted = ((old >> 18) ^ old) >> 27;
+			uint32_t rotation = old >> 59;
+			return (shifted >> rotation) | (shifted << (-rotation & 31));
 		}
+		case wyrand: {
+			uint64_t hi, lo;
+			state[0] += 0xa0761d6478bd642f;
+			multiply(state[0], state[0] ^ 0xe7037ed1a0b428db, hi, lo);
+			return (hi ^ lo) >> 32;
+		}
+		case mt19937:
+			break;
 	}
-	return final;
+	return (*twister)();
 }
 
+// Pick one of n alternatives, for n up to 2^32; shared by the tree and
+// the Program interpreter so both consume the random stream
+// identically. Lemire's multiply-and-reject keeps every choice exactly
+// as likely as the others, which weighted choices rely on.
+size_t Rng::choose(size_t n)
+{
+	uint64_t m = uint64_t(next()) * n;
+	uint32_t low = m;
+	if (low < n) {
+		uint32_t threshold = uint32_t(-n) % n;
+		while (low < threshold) {
+			m = uint64_t(next()) * n;
+			low = m;
+		}
+	}
+	return m >> 32;
+}
 
-std::string Random::toString()
+// One draw from an alias table laid out as by vose(); shared by the
+// tree and both interpreters
+static size_t pick(Rng& rng, size_t n, size_t total, const uint32_t* prob, const uint32_t* alias)
 {
-	if (!generators.size()) {
-		return "";
+	size_t i = rng.choose(n);
+	if (rng.choose(total) >= prob[i]) {
+		i = alias[i];
 	}
-	std::uniform_real_distribution<double> distribution(0, generators.size() - 1);
-	int rnd = distribution(rng) + 0.5;
-	return generators[rnd]->toString();
+	return i;
 }
 
 
-Sequence::Sequence()
+// A chance in [0, 1), to 53 bits.
+static double uniform(Rng& rng)
 {
+	uint64_t high = rng.next() >> 5;
+	uint64_t low = rng.next() >> 6;
+	return (high * 67108864.0 + low) / 9007199254740992.0;
 }
 
-Sequence::Sequence(std::vector<std::unique_ptr<Generator>>&& generators_) :
-	Generator(std::move(generators_))
+
+// Fill a Batch from anything with generate(std::string&, Rng&). The
+// arena is sized up front for names of `mean' bytes, with an eighth to
+// spare, so it is usually allocated once; names that run longer grow
+// it. Sizing it from the mean rather than from `longest' keeps a long
+// but rare alternative from reserving its length for every name.
+template<typename T>
+static Batch fill(const T& generator, size_t n, Rng& rng, double mean, size_t longest)
 {
+	Batch batch;
+	const void* arena = batch.arena.data();
+	const void* offsets = nullptr;
+	Counter::grown(batch.offsets, offsets);
+	double bytes = std::min((mean + 1) * 1.125, double(longest) + 1) * n;
+	if (bytes < batch.arena.max_size()) {
+		batch.arena.reserve(bytes);
+	}
+	batch.offsets.reserve(n + 1);
+	Counter::grown(batch.offsets, offsets);
+	for (size_t i = 0; i < n; i++) {
+		generator.generate(batch.arena, rng);
+		batch.arena.push_back('\0');
+		batch.offsets.push_back(batch.arena.size());
+		Counter::grown(batch.arena, arena);
+	}
+	Counter::count(n, 0, 0);
+	return batch;
 }
 
-Literal::Literal(const std::string &value_) :
-	value(value_)
+template<typename T>
+static Batch fill(const T& generator, size_t n, Rng& rng)
 {
+	return fill(generator, n, rng, generator.mean(), generator.max());
 }
 
-size_t Literal::combinations()
+
+// Saturating arithmetic for combinations(); these return true when the
+// true result did not fit.
+
+static bool mul_overflow(size_t a, size_t b, size_t& r)
 {
-	return 1;
+	if (a && b > SIZE_MAX / a) {
+		r = SIZE_MAX;
+		return true;
+	}
+	r = a * b;
+	return false;
 }
 
-size_t Literal::min()
+
+static bool add_overflow(size_t a, size_t b, size_t& r)
 {
-	return value.size();
+	if (b > SIZE_MAX - a) {
+		r = SIZE_MAX;
+		return true;
+	}
+	r = a + b;
+	return false;
 }
 
-size_t Literal::max()
+
+static size_t add_saturate(size_t a, size_t b)
 {
-	return value.size();
+	return b > SIZE_MAX - a ? SIZE_MAX : a + b;
 }
 
-std::string Literal::toString()
+
+Alias::Alias(const std::vector<size_t>& weights) :
+	prob(weights.size()),
+	alias(weights.size()),
+	starts(1, 0)
 {
-	return value;
+	size_t n = weights.size();
+	size_t total = 0;
+	for (auto w : weights) {
+		if (!w) {
+			throw std::invalid_argument("Zero weight");
+		} else if (w > UINT32_MAX || add_overflow(total, w, total)) {
+			throw std::invalid_argument("Weights too large");
+		}
+		starts.push_back(total);
+	}
+	if (n && total > UINT32_MAX / n) {
+		throw std::invalid_argument("Weights too large");
+	}
+	std::vector<uint32_t> w(weights.begin(), weights.end());
+	std::vector<uint32_t> work(n);
+	vose<uint32_t>(w.data(), n, total, prob.data(), alias.data(), work.data());
 }
 
-Reverser::Reverser(std::unique_ptr<Generator>&& g)
+size_t Alias::size() const
 {
-	add(std::move(g));
+	return prob.size();
 }
 
+size_t Alias::total() const
+{
+	return starts.back();
+}
 
-std::string Reverser::toString()
+size_t Alias::weight(size_t i) const
 {
-	std::wstring str = towstring(Generator::toString());
-	std::reverse(str.begin(), str.end());
-	return tostring(str);
+	return starts[i + 1] - starts[i];
 }
 
-Capitalizer::Capitalizer(std::unique_ptr<Generator>&& g)
+size_t Alias::start(size_t i) const
 {
-	add(std::move(g));
+	return starts[i];
 }
 
-std::string Capitalizer::toString()
+size_t Alias::find(size_t index) const
 {
-	std::wstring str = towstring(Generator::toString());
-	str[0] = std::towupper(str[0]);
-	return tostring(str);
+	return std::upper_bound(starts.begin(), starts.end(), index) - starts.begin() - 1;
 }
 
+size_t Alias::choose(Rng& rng) const
+{
+	if (size() < 2) {
+		return 0;
+	}
+	return pick(rng, size(), total(), prob.data(), alias.data());
+}
 
-Collapser::Collapser(std::unique_ptr<Generator>&& g)
+size_t Alias::memory() const
 {
-	add(std::move(g));
+	return sizeof(*this) + (prob.capacity() + alias.capacity()) * sizeof(uint32_t) +
+	       starts.capacity() * sizeof(size_t);
 }
 
-std::string Collapser::toString()
+size_t Alias::allocations() const
 {
-	std::wstring str = towstring(Generator::toString());
-	std::wstring out;
-	int cnt = 0;
-	wchar_t pch = L'\0';
-	for (auto ch : str) {
-		if (ch == pch) {
-			cnt++;
-		} else {
-			cnt = 0;
-		}
-		int mch = 2;
-		switch(ch) {
-			case 'a':
-			case 'h':
-			case 'i':
-			case 'j':
-			case 'q':
-			case 'u':
-			case 'v':
-			case 'w':
-			case 'x':
-			case 'y':
-				mch = 1;
-		}
-		if (cnt < mch) {
-			out.push_back(ch);
-		}
-		pch = ch;
+	// make_shared places the alias and its count in one block
+	return 1 + (prob.capacity() ? 1 : 0) + (alias.capacity() ? 1 : 0) + (starts.capacity() ? 1 : 0);
+}
+
+void Alias::compile(Program& program) const
+{
+	program.emit(total());
+	for (auto p : prob) {
+		program.emit(p);
+	}
+	for (auto a : alias) {
+		program.emit(a);
 	}
-	return tostring(out);
 }
 
 
-Generator::Generator(const std::string &pattern, bool collapse_triples) {
-	std::unique_ptr<Generator> last;
+namespace {
 
-	std::stack<std::unique_ptr<Group>> stack;
-	std::unique_ptr<Group> top = make_unique<GroupSymbol>();
+uint64_t mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111eb;
+	x ^= x >> 31;
+	return x;
+}
 
-	for (auto c : pattern) {
-		switch (c) {
-			case '<':
-				stack.push(std::move(top));
-				top = make_unique<GroupSymbol>();
-				break;
-			case '(':
-				stack.push(std::move(top));
-				top = make_unique<GroupLiteral>();
-				break;
-			case '>':
-			case ')':
-				if (stack.size() == 0) {
-					throw std::invalid_argument("Unbalanced brackets");
-				} else if (c == '>' && top->type != group_types::symbol) {
-					throw std::invalid_argument("Unexpected '>' in pattern");
-				} else if (c == ')' && top->type != group_types::literal) {
-					throw std::invalid_argument("Unexpected ')' in pattern");
-				}
-                                last = top->produce();
-				top = std::move(stack.top());
-				stack.pop();
-				top->add(std::move(last));
-				break;
-			case '|':
-				top->split();
-				break;
-			case '!':
-				if (top->type == group_types::symbol) {
-					top->wrap(wrappers::capitalizer);
-				} else {
-					top->add(c);
-				}
-				break;
-			case '~':
-				if (top->type == group_types::symbol) {
-					top->wrap(wrappers::reverser);
-				} else {
-					top->add(c);
+
+uint64_t hash(const char* s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3;
+	}
+	return mix(h);
+}
+
+
+// Open-addressing set over the names already in a Batch. Each slot
+// packs the upper half of a name's hash with its index, so almost every
+// probe is settled without touching the arena.
+class Fingerprints
+{
+	const Batch& batch;
+	std::vector<uint64_t> slots;
+	size_t mask;
+
+public:
+	Fingerprints(const Batch& batch_, size_t n) :
+		batch(batch_)
+	{
+		size_t size = 16;
+		while (size < 2 * n) {
+			size *= 2;
+		}
+		slots.resize(size);
+		mask = size - 1;
+	}
+
+	// Insert name `i' of the batch, returning false if already present.
+	bool insert(size_t i)
+	{
+		const char* name = batch[i];
+		size_t len = batch.length(i);
+		uint64_t h = hash(name, len);
+		uint64_t tag = h & 0xffffffff00000000;
+		for (size_t at = h & mask;; at = (at + 1) & mask) {
+			uint64_t slot = slots[at];
+			if (!slot) {
+				slots[at] = tag | (i + 1);
+				return true;
+			}
+			if ((slot & 0xffffffff00000000) == tag) {
+				size_t j = (slot & 0xffffffff) - 1;
+				if (batch.length(j) == len && !std::memcmp(batch[j], name, len)) {
+					return false;
 				}
-				break;
-			default:
-				top->add(c);
-				break;
+			}
 		}
 	}
+};
 
-	if (stack.size() != 0) {
-		throw std::invalid_argument("Missing closing bracket");
+
+// A random bijection on [0, n): a Feistel network over the next power
+// of four, walking back into range when it lands outside.
+class Permutation
+{
+	uint64_t n;
+	unsigned half;
+	uint64_t keys[4];
+
+public:
+	Permutation(uint64_t n_, Rng& rng) :
+		n(n_),
+		half(1)
+	{
+		while (half < 32 && (uint64_t(1) << (2 * half)) < n) {
+			half++;
+		}
+		for (auto& key : keys) {
+			key = uint64_t(rng.next()) << 32 | rng.next();
+		}
 	}
 
-        std::unique_ptr<Generator> g = top->produce();
-	if (collapse_triples) {
-		g = make_unique<Collapser>(std::move(g));
+	uint64_t operator()(uint64_t x) const
+	{
+		uint64_t m = (uint64_t(1) << half) - 1;
+		do {
+			uint64_t l = x >> half;
+			uint64_t r = x & m;
+			for (auto key : keys) {
+				uint64_t t = l ^ (mix(r ^ key) & m);
+				l = r;
+				r = t;
+			}
+			x = l << half | r;
+		} while (x >= n);
+		return x;
 	}
-	add(std::move(g));
+};
+
 }
 
 
-Generator::Group::Group(group_types_t type_) :
-	type(type_)
+// Used whenever the caller does not bring its own Rng.
+static Rng& defaultRng()
 {
+	static thread_local Rng rng;
+	return rng;
 }
 
-void Generator::Group::add(std::unique_ptr<Generator>&& g)
+
+// Transformations applied in place to the output past `from'. They
+// work directly on UTF-8 bytes with a fast path for ASCII, so they
+// neither allocate nor depend on the process locale. Bytes that are not
+// part of a well-formed sequence are treated as characters of their own.
+
+// Decode the character at s[i] of the `size' bytes at `s', storing its
+// length in bytes in `len'.
+static uint32_t decode(const char* s, size_t size, size_t i, size_t& len)
 {
-	while (!wrappers.empty()) {
-		switch (wrappers.top()) {
-			case reverser:
-				g = make_unique<Reverser>(std::move(g));
-				break;
-			case capitalizer:
-				g = make_unique<Capitalizer>(std::move(g));
-				break;
-		}
-		wrappers.pop();
+	unsigned char c = s[i];
+	if (c < 0x80) {
+		len = 1;
+		return c;
+	}
+	size_t n = c >= 0xc2 && c < 0xe0 ? 2 : c >= 0xe0 && c < 0xf0 ? 3 : c >= 0xf0 && c < 0xf5 ? 4 : 0;
+	uint32_t ch = n == 2 ? c & 0x1f : n == 3 ? c & 0x0f : c & 0x07;
+	if (n == 0 || i + n > size) {
+		len = 1;
+		return 0x110000 + c;
 	}
-	if (set.size() == 0) {
-		set.push_back(make_unique<Sequence>());
+	for (size_t k = 1; k < n; k++) {
+		unsigned char cc = s[i + k];
+		if ((cc & 0xc0) != 0x80) {
+			len = 1;
+			return 0x110000 + c;
+		}
+		ch = (ch << 6) | (cc & 0x3f);
 	}
-	set.back()->add(std::move(g));
+	len = n;
+	return ch;
 }
 
-void Generator::Group::add(char c)
+static uint32_t decode(const std::string& s, size_t i, size_t& len)
 {
-	std::string value(1, c);
-	std::unique_ptr<Generator> g = make_unique<Random>();
-	g->add(make_unique<Literal>(value));
-	Group::add(std::move(g));
+	return decode(s.data(), s.size(), i, len);
 }
 
-std::unique_ptr<Generator> Generator::Group::produce()
+
+static std::string encode(uint32_t ch)
 {
-	switch (set.size()) {
-		case 0:
-			return make_unique<Literal>("");
-		case 1:
-			return std::move(*set.begin());
-		default:
-			return make_unique<Random>(std::move(set));
+	std::string s;
+	if (ch < 0x80) {
+		s.push_back(ch);
+	} else if (ch < 0x800) {
+		s.push_back(0xc0 | (ch >> 6));
+		s.push_back(0x80 | (ch & 0x3f));
+	} else if (ch < 0x10000) {
+		s.push_back(0xe0 | (ch >> 12));
+		s.push_back(0x80 | ((ch >> 6) & 0x3f));
+		s.push_back(0x80 | (ch & 0x3f));
+	} else {
+		s.push_back(0xf0 | (ch >> 18));
+		s.push_back(0x80 | ((ch >> 12) & 0x3f));
+		s.push_back(0x80 | ((ch >> 6) & 0x3f));
+		s.push_back(0x80 | (ch & 0x3f));
 	}
+	return s;
 }
 
-void Generator::Group::split()
+
+// Simple uppercase mappings, as UnicodeData.txt gives them for Unicode
+// 14: from `first' to `last', every `step'th character is `delta' away
+// from its uppercase. Characters in none of these have no uppercase of
+// their own, and so names are capitalized the same everywhere.
+static const struct Upper {
+	uint32_t first;
+	uint32_t last;
+	int32_t delta;
+	uint32_t step;
+} uppers[] = {
+	{0xb5, 0xb5, 743, 1}, {0xe0, 0xf6, -32, 1}, {0xf8, 0xfe, -32, 1},
+	{0xff, 0xff, 121, 1}, {0x101, 0x12f, -1, 2}, {0x131, 0x131, -232, 1},
+	{0x133, 0x137, -1, 2}, {0x13a, 0x148, -1, 2}, {0x14b, 0x177, -1, 2},
+	{0x17a, 0x17e, -1, 2}, {0x17f, 0x17f, -300, 1}, {0x180, 0x180, 195, 1},
+	{0x183, 0x185, -1, 2}, {0x188, 0x188, -1, 1}, {0x18c, 0x18c, -1, 1},
+	{0x192, 0x192, -1, 1}, {0x195, 0x195, 97, 1}, {0x199, 0x199, -1, 1},
+	{0x19a, 0x19a, 163, 1}, {0x19e, 0x19e, 130, 1}, {0x1a1, 0x1a5, -1, 2},
+	{0x1a8, 0x1a8, -1, 1}, {0x1ad, 0x1ad, -1, 1}, {0x1b0, 0x1b0, -1, 1},
+	{0x1b4, 0x1b6, -1, 2}, {0x1b9, 0x1b9, -1, 1}, {0x1bd, 0x1bd, -1, 1},
+	{0x1bf, 0x1bf, 56, 1}, {0x1c5, 0x1c5, -1, 1}, {0x1c6, 0x1c6, -2, 1},
+	{0x1c8, 0x1c8, -1, 1}, {0x1c9, 0x1c9, -2, 1}, {0x1cb, 0x1cb, -1, 1},
+	{0x1cc, 0x1cc, -2, 1}, {0x1ce, 0x1dc, -1, 2}, {0x1dd, 0x1dd, -79, 1},
+	{0x1df, 0x1ef, -1, 2}, {0x1f2, 0x1f2, -1, 1}, {0x1f3, 0x1f3, -2, 1},
+	{0x1f5, 0x1f5, -1, 1}, {0x1f9, 0x21f, -1, 2}, {0x223, 0x233, -1, 2},
+	{0x23c, 0x23c, -1, 1}, {0x23f, 0x240, 10815, 1}, {0x242, 0x242, -1, 1},
+	{0x247, 0x24f, -1, 2}, {0x250, 0x250, 10783, 1},
+	{0x251, 0x251, 10780, 1}, {0x252, 0x252, 10782, 1},
+	{0x253, 0x253, -210, 1}, {0x254, 0x254, -206, 1},
+	{0x256, 0x257, -205, 1}, {0x259, 0x259, -202, 1},
+	{0x25b, 0x25b, -203, 1}, {0x25c, 0x25c, 42319, 1},
+	{0x260, 0x260, -205, 1}, {0x261, 0x261, 42315, 1},
+	{0x263, 0x263, -207, 1}, {0x265, 0x265, 42280, 1},
+	{0x266, 0x266, 42308, 1}, {0x268, 0x268, -209, 1},
+	{0x269, 0x269, -211, 1}, {0x26a, 0x26a, 42308, 1},
+	{0x26b, 0x26b, 10743, 1}, {0x26c, 0x26c, 42305, 1},
+	{0x26f, 0x26f, -211, 1}, {0x271, 0x271, 10749, 1},
+	{0x272, 0x272, -213, 1}, {0x275, 0x275, -214, 1},
+	{0x27d, 0x27d, 10727, 1}, {0x280, 0x280, -218, 1},
+	{0x282, 0x282, 42307, 1}, {0x283, 0x283, -218, 1},
+	{0x287, 0x287, 42282, 1}, {0x288, 0x288, -218, 1},
+	{0x289, 0x289, -69, 1}, {0x28a, 0x28b, -217, 1},
+	{0x28c, 0x28c, -71, 1}, {0x292, 0x292, -219, 1},
+	{0x29d, 0x29d, 42261, 1}, {0x29e, 0x29e, 42258, 1},
+	{0x345, 0x345, 84, 1}, {0x371, 0x373, -1, 2}, {0x377, 0x377, -1, 1},
+	{0x37b, 0x37d, 130, 1}, {0x3ac, 0x3ac, -38, 1}, {0x3ad, 0x3af, -37, 1},
+	{0x3b1, 0x3c1, -32, 1}, {0x3c2, 0x3c2, -31, 1}, {0x3c3, 0x3cb, -32, 1},
+	{0x3cc, 0x3cc, -64, 1}, {0x3cd, 0x3ce, -63, 1}, {0x3d0, 0x3d0, -62, 1},
+	{0x3d1, 0x3d1, -57, 1}, {0x3d5, 0x3d5, -47, 1}, {0x3d6, 0x3d6, -54, 1},
+	{0x3d7, 0x3d7, -8, 1}, {0x3d9, 0x3ef, -1, 2}, {0x3f0, 0x3f0, -86, 1},
+	{0x3f1, 0x3f1, -80, 1}, {0x3f2, 0x3f2, 7, 1}, {0x3f3, 0x3f3, -116, 1},
+	{0x3f5, 0x3f5, -96, 1}, {0x3f8, 0x3f8, -1, 1}, {0x3fb, 0x3fb, -1, 1},
+	{0x430, 0x44f, -32, 1}, {0x450, 0x45f, -80, 1}, {0x461, 0x481, -1, 2},
+	{0x48b, 0x4bf, -1, 2}, {0x4c2, 0x4ce, -1, 2}, {0x4cf, 0x4cf, -15, 1},
+	{0x4d1, 0x52f, -1, 2}, {0x561, 0x586, -48, 1},
+	{0x10d0, 0x10fa, 3008, 1}, {0x10fd, 0x10ff, 3008, 1},
+	{0x13f8, 0x13fd, -8, 1}, {0x1c80, 0x1c80, -6254, 1},
+	{0x1c81, 0x1c81, -6253, 1}, {0x1c82, 0x1c82, -6244, 1},
+	{0x1c83, 0x1c84, -6242, 1}, {0x1c85, 0x1c85, -6243, 1},
+	{0x1c86, 0x1c86, -6236, 1}, {0x1c87, 0x1c87, -6181, 1},
+	{0x1c88, 0x1c88, 35266, 1}, {0x1d79, 0x1d79, 35332, 1},
+	{0x1d7d, 0x1d7d, 3814, 1}, {0x1d8e, 0x1d8e, 35384, 1},
+	{0x1e01, 0x1e95, -1, 2}, {0x1e9b, 0x1e9b, -59, 1},
+	{0x1ea1, 0x1eff, -1, 2}, {0x1f00, 0x1f07, 8, 1},
+	{0x1f10, 0x1f15, 8, 1}, {0x1f20, 0x1f27, 8, 1}, {0x1f30, 0x1f37, 8, 1},
+	{0x1f40, 0x1f45, 8, 1}, {0x1f51, 0x1f57, 8, 2}, {0x1f60, 0x1f67, 8, 1},
+	{0x1f70, 0x1f71, 74, 1}, {0x1f72, 0x1f75, 86, 1},
+	{0x1f76, 0x1f77, 100, 1}, {0x1f78, 0x1f79, 128, 1},
+	{0x1f7a, 0x1f7b, 112, 1}, {0x1f7c, 0x1f7d, 126, 1},
+	{0x1f80, 0x1f87, 8, 1}, {0x1f90, 0x1f97, 8, 1}, {0x1fa0, 0x1fa7, 8, 1},
+	{0x1fb0, 0x1fb1, 8, 1}, {0x1fb3, 0x1fb3, 9, 1},
+	{0x1fbe, 0x1fbe, -7205, 1}, {0x1fc3, 0x1fc3, 9, 1},
+	{0x1fd0, 0x1fd1, 8, 1}, {0x1fe0, 0x1fe1, 8, 1}, {0x1fe5, 0x1fe5, 7, 1},
+	{0x1ff3, 0x1ff3, 9, 1}, {0x214e, 0x214e, -28, 1},
+	{0x2170, 0x217f, -16, 1}, {0x2184, 0x2184, -1, 1},
+	{0x24d0, 0x24e9, -26, 1}, {0x2c30, 0x2c5f, -48, 1},
+	{0x2c61, 0x2c61, -1, 1}, {0x2c65, 0x2c65, -10795, 1},
+	{0x2c66, 0x2c66, -10792, 1}, {0x2c68, 0x2c6c, -1, 2},
+	{0x2c73, 0x2c73, -1, 1}, {0x2c76, 0x2c76, -1, 1},
+	{0x2c81, 0x2ce3, -1, 2}, {0x2cec, 0x2cee, -1, 2},
+	{0x2cf3, 0x2cf3, -1, 1}, {0x2d00, 0x2d25, -7264, 1},
+	{0x2d27, 0x2d27, -7264, 1}, {0x2d2d, 0x2d2d, -7264, 1},
+	{0xa641, 0xa66d, -1, 2}, {0xa681, 0xa69b, -1, 2},
+	{0xa723, 0xa72f, -1, 2}, {0xa733, 0xa76f, -1, 2},
+	{0xa77a, 0xa77c, -1, 2}, {0xa77f, 0xa787, -1, 2},
+	{0xa78c, 0xa78c, -1, 1}, {0xa791, 0xa793, -1, 2},
+	{0xa794, 0xa794, 48, 1}, {0xa797, 0xa7a9, -1, 2},
+	{0xa7b5, 0xa7c3, -1, 2}, {0xa7c8, 0xa7ca, -1, 2},
+	{0xa7d1, 0xa7d1, -1, 1}, {0xa7d7, 0xa7d9, -1, 2},
+	{0xa7f6, 0xa7f6, -1, 1}, {0xab53, 0xab53, -928, 1},
+	{0xab70, 0xabbf, -38864, 1}, {0xff41, 0xff5a, -32, 1},
+	{0x10428, 0x1044f, -40, 1}, {0x104d8, 0x104fb, -40, 1},
+	{0x10597, 0x105a1, -39, 1}, {0x105a3, 0x105b1, -39, 1},
+	{0x105b3, 0x105b9, -39, 1}, {0x105bb, 0x105bc, -39, 1},
+	{0x10cc0, 0x10cf2, -64, 1}, {0x118c0, 0x118df, -32, 1},
+	{0x16e60, 0x16e7f, -32, 1}, {0x1e922, 0x1e943, -34, 1},
+};
+
+
+// Uppercase of `ch', or `ch' itself if it has none.
+static uint32_t upper(uint32_t ch)
 {
-	if (set.size() == 0) {
-		set.push_back(make_unique<Sequence>());
+	const Upper* end = uppers + sizeof(uppers) / sizeof(*uppers);
+	const Upper* u = std::lower_bound(uppers, end, ch, [](const Upper& u, uint32_t ch) { return u.last < ch; });
+	if (u != end && ch >= u->first && (ch - u->first) % u->step == 0) {
+		return ch + u->delta;
 	}
-	set.push_back(make_unique<Sequence>());
+	return ch;
 }
 
-void Generator::Group::wrap(wrappers_t type)
+
+static void capitalize(std::string& s, size_t from)
 {
-	wrappers.push(type);
+	if (from >= s.size()) {
+		return;
+	}
+	unsigned char c = s[from];
+	if (c < 0x80) {
+		if (c >= 'a' && c <= 'z') {
+			s[from] = c - 0x20;
+		}
+		return;
+	}
+	size_t len;
+	uint32_t ch = decode(s, from, len);
+	uint32_t up = ch < 0x110000 ? upper(ch) : ch;
+	if (up != ch) {
+		s.replace(from, len, encode(up));
+	}
 }
 
-Generator::GroupSymbol::GroupSymbol() :
-	Group(group_types::symbol)
+
+static void reverse(std::string& s, size_t from)
 {
+	if (from >= s.size()) {
+		return;
+	}
+	// Reverse the bytes of each multibyte character first, so that
+	// reversing the whole run restores them.
+	for (size_t i = from; i < s.size();) {
+		size_t len;
+		if ((unsigned char)s[i] < 0x80) {
+			len = 1;
+		} else {
+			decode(s, i, len);
+			std::reverse(s.begin() + i, s.begin() + i + len);
+		}
+		i += len;
+	}
+	std::reverse(s.begin() + from, s.end());
 }
 
-void Generator::GroupSymbol::add(char c)
+
+// Whether a run of `ch' is cut short after its first repeat rather
+// than its second.
+static inline bool doubled(uint32_t ch)
 {
-	std::string value(1, c);
-	std::unique_ptr<Generator> g = make_unique<Random>();
-	try {
-		static const auto& symbols = SymbolMap();
-		for (const auto& s : symbols.at(value)) {
-			g->add(make_unique<Literal>(s));
-		}
-	} catch (const std::out_of_range&) {
-		g->add(make_unique<Literal>(value));
+	switch (ch) {
+		case 'a':
+		case 'h':
+		case 'i':
+		case 'j':
+		case 'q':
+		case 'u':
+		case 'v':
+		case 'w':
+		case 'x':
+		case 'y':
+			return true;
 	}
-	Group::add(std::move(g));
+	return false;
 }
 
-Generator::GroupLiteral::GroupLiteral() :
-	Group(group_types::literal)
+
+// Blocks of bytes looked over at once by collapse(), with the widest
+// vectors the build allows. plain() says whether the block at s[i] is
+// all ASCII with no byte equal to the one before it, leaving out the
+// first, and flags its NULs in `nuls'; lowest() finds the first flag.
+#if defined(__AVX2__)
+static const size_t block = 32;
+
+static inline bool plain(const char* s, size_t i, uint32_t& nuls)
+{
+	__m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+	__m256i prev = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i - 1));
+	uint32_t repeats = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, prev));
+	nuls = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, _mm256_setzero_si256()));
+	return !(_mm256_movemask_epi8(cur) | (repeats & ~1u));
+}
+
+static inline size_t lowest(uint32_t flags)
+{
+	return __builtin_ctz(flags);
+}
+#elif defined(__SSE2__)
+static const size_t block = 16;
+
+static inline bool plain(const char* s, size_t i, uint32_t& nuls)
 {
+	__m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+	__m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i - 1));
+	uint32_t repeats = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, prev));
+	nuls = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, _mm_setzero_si128()));
+	return !(_mm_movemask_epi8(cur) | (repeats & ~1u));
+}
+
+static inline size_t lowest(uint32_t flags)
+{
+	return __builtin_ctz(flags);
+}
+#else
+static const size_t block = 0;
+
+static inline bool plain(const char*, size_t, uint32_t&)
+{
+	return false;
+}
+
+static inline size_t lowest(uint32_t)
+{
+	return 0;
+}
+#endif
+
+
+// Collapse runs of the same character in place in the `n' bytes at `s',
+// which are either one name or a batch of names each ended by a NUL, and
+// return how many bytes are left. For a batch, the end of each name,
+// past its NUL, is stored through `ends'.
+//
+// Names are mostly ASCII with few repeated letters, so whole blocks that
+// plain() passes are only moved along, and just their NULs looked at.
+// Other blocks, and whatever is left at the end, go a character at a
+// time.
+static size_t collapse(char* s, size_t n, size_t* ends=nullptr)
+{
+	size_t out = 0;
+	int cnt = 0;
+	uint32_t pch = 0;
+	for (size_t i = 0; i < n;) {
+		// The byte before a block may have been overwritten by now, so
+		// its first byte is checked against `pch' instead
+		uint32_t nuls;
+		while (block && i && i + block <= n && (unsigned char)s[i] != pch && plain(s, i, nuls)) {
+			pch = (unsigned char)s[i + block - 1];
+			std::memmove(s + out, s + i, block);
+			for (; nuls && ends; nuls &= nuls - 1) {
+				*ends++ = out + lowest(nuls) + 1;
+			}
+			cnt = 0;
+			i += block;
+			out += block;
+		}
+		if (i >= n) {
+			break;
+		}
+
+		unsigned char c = s[i];
+		size_t len = 1;
+		uint32_t ch = c < 0x80 ? c : decode(s, n, i, len);
+		if (!c && ends) {
+			// The end of a name, which no run crosses
+			s[out++] = 0;
+			*ends++ = out;
+			cnt = 0;
+			pch = 0;
+			i++;
+			continue;
+		}
+		cnt = ch == pch ? cnt + 1 : 0;
+		if (cnt < (doubled(ch) ? 1 : 2)) {
+			if (out != i) {
+				std::copy(s + i, s + i + len, s + out);
+			}
+			out += len;
+		}
+		pch = ch;
+		i += len;
+	}
+	return out;
+}
+
+
+static void collapse(std::string& s, size_t from)
+{
+	if (from < s.size()) {
+		s.resize(from + collapse(&s[from], s.size() - from));
+	}
+}
+
+
+// Matching a name against output that passes through a Capitalizer or
+// Collapser works a character at a time. Nodes may split a multibyte
+// character between them, so bytes are gathered in the match until the
+// character is complete. With no name, any output matches, and `pos'
+// counts the bytes that come out.
+
+// Continue matching `name' at `m' with one whole character.
+static bool put(const std::string* name, Generator::Match& m, uint32_t ch, const char* bytes, size_t n)
+{
+	std::string upcased;
+	if (m.capitalize) {
+		m.capitalize = 0;
+		uint32_t up = ch < 0x110000 ? upper(ch) : ch;
+		if (up != ch) {
+			ch = up;
+			upcased = encode(up);
+			bytes = upcased.data();
+			n = upcased.size();
+		}
+	}
+	if (m.collapsing) {
+		m.cnt = ch != m.pch ? 0 : m.cnt < 2 ? m.cnt + 1 : 2;
+		m.pch = ch;
+		int mch = 2;
+		switch(ch) {
+			case 'a':
+			case 'h':
+			case 'i':
+			case 'j':
+			case 'q':
+			case 'u':
+			case 'v':
+			case 'w':
+			case 'x':
+			case 'y':
+				mch = 1;
+		}
+		if (m.cnt >= mch) {
+			return true;
+		}
+	}
+	if (name && name->compare(m.pos, n, bytes, n)) {
+		return false;
+	}
+	m.pos += n;
+	return true;
+}
+
+
+// Give up on an incomplete character: its bytes stand on their own.
+static bool flush(const std::string* name, Generator::Match& m)
+{
+	int have = m.have;
+	m.have = 0;
+	for (int k = 0; k < have; k++) {
+		char c = m.partial >> (8 * k);
+		if (!put(name, m, 0x110000 + (unsigned char)c, &c, 1)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Continue matching `name' at `m' against the output `text'.
+static bool feed(const std::string* name, Generator::Match& m, const std::string& text)
+{
+	if (!m.capitalize && !m.collapsing && !m.have) {
+		if (name && name->compare(m.pos, text.size(), text)) {
+			return false;
+		}
+		m.pos += text.size();
+		return true;
+	}
+	for (unsigned char c : text) {
+		if (m.have) {
+			if ((c & 0xc0) == 0x80) {
+				m.partial |= uint32_t(c) << (8 * m.have++);
+				if (m.have == m.need) {
+					char bytes[4];
+					for (int k = 0; k < m.have; k++) {
+						bytes[k] = m.partial >> (8 * k);
+					}
+					size_t len;
+					uint32_t ch = decode(std::string(bytes, m.have), 0, len);
+					m.have = 0;
+					if (!put(name, m, ch, bytes, len)) {
+						return false;
+					}
+				}
+				continue;
+			} else if (!flush(name, m)) {
+				return false;
+			}
+		}
+		if (c >= 0xc2 && c < 0xf5) {
+			m.partial = c;
+			m.have = 1;
+			m.need = c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+		} else {
+			char b = c;
+			if (!put(name, m, c < 0x80 ? c : 0x110000 + c, &b, 1)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+
+// Add a match to `out', keeping only the smallest index for each state.
+static void keep(std::vector<Generator::Match>& out, const Generator::Match& m)
+{
+	for (auto& o : out) {
+		if (o.pos == m.pos && o.pch == m.pch && o.cnt == m.cnt &&
+		    o.collapsing == m.collapsing && o.capitalize == m.capitalize && o.reversed == m.reversed &&
+		    o.have == m.have && (!m.have || o.partial == m.partial)) {
+			if (m.index < o.index) {
+				o.index = m.index;
+			}
+			return;
+		}
+	}
+	out.push_back(m);
+}
+
+
+// Copy a generated name into a caller's buffer, truncating as needed.
+static size_t copy(const std::string& s, char* dst, size_t len)
+{
+	if (len) {
+		size_t n = s.size() < len ? s.size() : len - 1;
+		s.copy(dst, n);
+		dst[n] = 0;
+	}
+	return s.size();
+}
+
+
+// https://isocpp.org/wiki/faq/ctors#static-init-order
+// Avoid the "static initialization order fiasco"
+const std::unordered_map<std::string, const std::vector<std::string>>& Generator::SymbolMap()
+{
+	static auto* const symbols = [] {
+		auto* map = new std::unordered_map<std::string, const std::vector<std::string>>();
+		for (auto& symbol : Symbols::all) {
+			map->emplace(std::string(1, symbol.symbol),
+				std::vector<std::string>(symbol.strings, symbol.strings + symbol.count));
+		}
+		return map;
+	}();
+
+	return *symbols;
+}
+
+
+#if defined(HAVE_CXX14) || __cplusplus >= 201402L
+using std::make_unique;
+#else
+// make_unique is not available in c++11, so we use this template function
+// to maintain full c++11 compatibility; std::make_unique is part of C++14.
+template<typename T, typename... Args>
+std::unique_ptr<T> make_unique(Args&&... args)
+{
+    return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
+}
+#endif
+
+
+Generator::Generator()
+{
+}
+
+
+Generator::Generator(std::vector<std::unique_ptr<Generator>>&& generators_) :
+	generators(std::move(generators_))
+{
+	for (auto& g : generators) {
+		include(*g);
+	}
+}
+
+
+size_t Generator::combinations() const
+{
+	return combos;
+}
+
+
+bool Generator::overflows() const
+{
+	return overflow;
+}
+
+
+size_t Generator::min() const
+{
+	return shortest;
+}
+
+
+size_t Generator::max() const
+{
+	return longest;
+}
+
+
+double Generator::mean() const
+{
+	return expected;
+}
+
+
+bool Generator::isAscii() const
+{
+	return ascii;
+}
+
+
+bool Generator::shrinks() const
+{
+	return shrinking;
+}
+
+
+bool Generator::resizes() const
+{
+	return resizing;
+}
+
+
+void Generator::include(const Generator& g)
+{
+	overflow |= g.overflows() | mul_overflow(combos, g.combinations(), combos);
+	ascii &= g.isAscii();
+	shrinking |= g.shrinks();
+	resizing |= g.resizes();
+	shortest = add_saturate(shortest, g.min());
+	longest = add_saturate(longest, g.max());
+	expected += g.mean();
+}
+
+
+std::string Generator::toString() const
+{
+	return toString(defaultRng());
+}
+
+
+std::string Generator::toString(Rng& rng) const
+{
+	static thread_local std::string scratch;
+	return returned(scratch, [&](std::string& out) { generate(out, rng); });
+}
+
+
+void Generator::generate(std::string& out) const
+{
+	generate(out, defaultRng());
+}
+
+
+size_t Generator::generate(char* dst, size_t len) const noexcept
+{
+	return generate(dst, len, defaultRng());
+}
+
+
+Batch Generator::generateBatch(size_t n, Rng& rng) const
+{
+	return fill(*this, n, rng);
+}
+
+
+Batch Generator::generateBatch(size_t n) const
+{
+	return generateBatch(n, defaultRng());
+}
+
+
+Batch Generator::generateUnique(size_t n, Rng& rng) const
+{
+	if (!overflow && n > combos) {
+		throw std::invalid_argument("Not enough combinations");
+	}
+	if (n >= 0xffffffff) {
+		throw std::invalid_argument("Too many names");
+	}
+
+	Batch batch;
+	const void* arena = batch.arena.data();
+	const void* offsets = nullptr;
+	Counter::grown(batch.offsets, offsets);
+	batch.offsets.reserve(n + 1);
+	Counter::grown(batch.offsets, offsets);
+	Fingerprints seen(batch, n);
+
+	// Draw names as usual while they are mostly new. Once `n' is a
+	// large share of the space, or a run of duplicates shows that it
+	// has become one, switch to drawing indices without replacement,
+	// uniformly rather than with the chances of toString().
+	// Either way, give up after 64 tries per name, and some to spare
+	// for small batches, as there may be fewer distinct names than
+	// indices.
+	bool sparse = overflow || n <= combos / 2;
+	size_t misses = 0;
+	size_t tries;
+	mul_overflow(n, 64, tries);
+	tries = add_saturate(tries, 1 << 16);
+	while (sparse && batch.size() < n) {
+		if (!tries--) {
+			throw std::invalid_argument("Not enough distinct names");
+		}
+		generate(batch.arena, rng);
+		batch.arena.push_back('\0');
+		batch.offsets.push_back(batch.arena.size());
+		Counter::grown(batch.arena, arena);
+		if (seen.insert(batch.size() - 1)) {
+			misses = 0;
+		} else {
+			batch.offsets.pop_back();
+			batch.arena.resize(batch.offsets.back());
+			sparse = ++misses < 64 || overflow;
+		}
+	}
+
+	if (batch.size() == n) {
+		Counter::count(n, 0, 0);
+		return batch;
+	}
+	Permutation permutation(combos, rng);
+	for (size_t i = 0; batch.size() < n; i++) {
+		if (i == combos || !tries--) {
+			throw std::invalid_argument("Not enough distinct names");
+		}
+		nameAt(batch.arena, permutation(i));
+		batch.arena.push_back('\0');
+		batch.offsets.push_back(batch.arena.size());
+		Counter::grown(batch.arena, arena);
+		if (!seen.insert(batch.size() - 1)) {
+			batch.offsets.pop_back();
+			batch.arena.resize(batch.offsets.back());
+		}
+	}
+	Counter::count(n, 0, 0);
+	return batch;
+}
+
+
+Batch Generator::generateUnique(size_t n) const
+{
+	return generateUnique(n, defaultRng());
+}
+
+
+void Generator::generate(std::string& out, size_t minLen, size_t maxLen, Rng& rng) const
+{
+	Bounded(*this, minLen, maxLen).generate(out, rng);
+}
+
+
+std::string Generator::toString(size_t minLen, size_t maxLen, Rng& rng) const
+{
+	static thread_local std::string scratch;
+	return returned(scratch, [&](std::string& out) { generate(out, minLen, maxLen, rng); });
+}
+
+
+std::string Generator::toString(size_t minLen, size_t maxLen) const
+{
+	return toString(minLen, maxLen, defaultRng());
+}
+
+
+// The states met while fitting names within lengths are numbered, and
+// each node keeps what it can do from each state it may start in.
+struct Generator::Lengths {
+	// One choice of a node: an alternative, a wrapper's child, or the
+	// strings of a leaf (or names tried whole) that add as many bytes
+	// and leave in the same state, so fit alike
+	struct Way {
+		double weight;
+		size_t bytes;        // output it adds
+		size_t state;        // state it leaves in, or a wrapper's child starts in
+		const double* fits;  // chances of fitting once it is done
+		size_t first;        // its strings in `members'
+		size_t count;
+	};
+
+	// A node started in some state
+	struct Start {
+		bool whole;
+		std::vector<size_t> ends;     // states it may leave in
+		std::vector<Way> ways;
+		std::vector<size_t> members;  // strings of a leaf, by way
+		std::vector<double> sums;     // running weights of those, unless all weigh the same
+		double total;                 // weight of the ways
+		std::vector<double> row;      // chances of fitting worked out for it
+		const double* fits;           // those or a child's, by bytes output so far
+
+		explicit Start(bool whole_=false) :
+			whole(whole_),
+			total(0),
+			fits(nullptr)
+		{
+		}
+	};
+
+	// Every start by node and state, in an open table at most half full,
+	// as it is looked up for every node drawn from
+	struct Slot {
+		const Generator* node;
+		size_t state;
+		Start* start;
+	};
+
+	struct Hash {
+		size_t operator()(const std::pair<uint64_t, uint64_t>& k) const
+		{
+			return size_t((k.first * 0x9e3779b97f4a7c15ULL ^ k.second) * 0xbf58476d1ce4e5b9ULL >> 16);
+		}
+	};
+
+	size_t maximum;  // bytes of the longest name that may fit
+	std::vector<Match> states;
+	std::unordered_map<std::pair<uint64_t, uint64_t>, size_t, Hash> numbers;
+	std::deque<Start> store;
+	std::vector<Slot> slots;
+	size_t used;
+	// Starts of each node, for fitting them
+	std::unordered_map<const Generator*, std::vector<std::pair<size_t, Start*>>> of;
+	// Bytes a wrapper adds and the state it leaves in, by its child's
+	// last state
+	std::unordered_map<const Generator*, std::unordered_map<size_t, std::pair<size_t, size_t>>> done;
+	std::list<std::vector<double>> rows;  // chances of fitting after wrappers
+
+	explicit Lengths(size_t maximum_) :
+		maximum(maximum_),
+		slots(16, Slot{nullptr, 0, nullptr}),
+		used(0)
+	{
+	}
+
+	// Number of state `m', whatever its position
+	size_t number(Match m)
+	{
+		m.pos = 0;
+		m.index = 0;
+		if (!m.have) {
+			m.partial = 0;
+			m.need = 0;
+		}
+		// Characters run up to 0x110000 and 255 more for stray bytes
+		uint64_t first = m.pch | uint64_t(m.cnt) << 21 | uint64_t(m.collapsing) << 23 |
+		                 uint64_t(m.reversed) << 24 | uint64_t(m.have) << 25 | uint64_t(m.need) << 27;
+		auto key = std::make_pair(first, m.partial | uint64_t(m.capitalize) << 32);
+		auto found = numbers.insert(std::make_pair(key, states.size()));
+		if (found.second) {
+			states.push_back(m);
+		}
+		return found.first->second;
+	}
+
+	size_t slot(const Generator* g, size_t state) const
+	{
+		uint64_t h = (uint64_t(uintptr_t(g)) + state * 0x9e3779b97f4a7c15ULL) * 0xbf58476d1ce4e5b9ULL;
+		return size_t(h >> 32) & (slots.size() - 1);
+	}
+
+	Start* find(const Generator* g, size_t state) const
+	{
+		for (size_t i = slot(g, state);; i = (i + 1) & (slots.size() - 1)) {
+			const Slot& s = slots[i];
+			if (!s.start || (s.node == g && s.state == state)) {
+				return s.start;
+			}
+		}
+	}
+
+	const Start& at(const Generator* g, size_t state) const
+	{
+		const Start* s = find(g, state);
+		if (!s) {
+			throw std::out_of_range("No such start");
+		}
+		return *s;
+	}
+
+	void put(const Slot& s)
+	{
+		size_t i = slot(s.node, s.state);
+		while (slots[i].start) {
+			i = (i + 1) & (slots.size() - 1);
+		}
+		slots[i] = s;
+	}
+
+	// Make `start' that of `g' in state `in'.
+	Start& add(const Generator& g, size_t in, Start* start)
+	{
+		if (2 * ++used > slots.size()) {
+			std::vector<Slot> old(2 * slots.size(), Slot{nullptr, 0, nullptr});
+			old.swap(slots);
+			for (auto& s : old) {
+				if (s.start) {
+					put(s);
+				}
+			}
+		}
+		put(Slot{&g, in, start});
+		of[&g].push_back(std::make_pair(in, start));
+		return *start;
+	}
+
+	Start& add(const Generator& g, size_t in, Start&& start)
+	{
+		store.push_back(std::move(start));
+		return add(g, in, &store.back());
+	}
+
+	// Start of `g' in state `in', reached first if need be
+	Start& start(const Generator& g, size_t in)
+	{
+		if (Start* s = find(&g, in)) {
+			return *s;
+		}
+		g.reach(*this, in);
+		return *find(&g, in);
+	}
+
+	// Whether leaf `g' in state `in' can do as it does with nothing
+	// collapsed before it, as `apart' tells if its strings all start with
+	// ASCII other than the last character; if so it is started the same.
+	template<typename F>
+	bool share(const Generator& g, size_t in, F apart)
+	{
+		Match m = states[in];
+		if (!m.collapsing || !m.pch || m.capitalize || m.have || m.reversed || !apart(m.pch)) {
+			return false;
+		}
+		m.pch = 0;
+		m.cnt = 0;
+		add(g, in, &start(g, number(m)));
+		return true;
+	}
+
+	// Start of a leaf with the strings `each', grouped into ways
+	static Start leaf(bool whole, const std::vector<Way>& each)
+	{
+		// Strings go to the way of their bytes and state, of which there
+		// are few, so ways are found by looking through them
+		Start start(whole);
+		std::vector<size_t> way(each.size());
+		bool even = true;
+		for (size_t i = 0; i < each.size(); i++) {
+			const Way& e = each[i];
+			size_t k = i ? way[i - 1] : 0;
+			if (k == start.ways.size() || e.bytes != start.ways[k].bytes || e.state != start.ways[k].state) {
+				for (k = 0; k < start.ways.size(); k++) {
+					if (e.bytes == start.ways[k].bytes && e.state == start.ways[k].state) {
+						break;
+					}
+				}
+				if (k == start.ways.size()) {
+					start.ways.push_back(Way{0, e.bytes, e.state, nullptr, 0, 0});
+					start.ends.push_back(e.state);
+				}
+			}
+			way[i] = k;
+			start.ways[k].weight += e.weight;
+			start.ways[k].count++;
+			start.total += e.weight;
+			even &= e.weight == each[0].weight;
+		}
+		for (size_t k = 1; k < start.ways.size(); k++) {
+			start.ways[k].first = start.ways[k - 1].first + start.ways[k - 1].count;
+		}
+		std::vector<size_t> filled(start.ways.size());
+		start.members.resize(each.size());
+		if (!even) {
+			start.sums.resize(each.size());
+		}
+		for (size_t i = 0; i < each.size(); i++) {
+			const Way& w = start.ways[way[i]];
+			size_t at = w.first + filled[way[i]]++;
+			start.members[at] = i;
+			if (!even) {
+				start.sums[at] = (at > w.first ? start.sums[at - 1] : 0) + each[i].weight;
+			}
+		}
+		// Heaviest first, for drawing to find sooner
+		std::stable_sort(start.ways.begin(), start.ways.end(), [](const Way& a, const Way& b) { return a.weight > b.weight; });
+		unique(start.ends);
+		return start;
+	}
+
+	// Sort `states' and keep one of each.
+	static void unique(std::vector<size_t>& states)
+	{
+		std::sort(states.begin(), states.end());
+		states.erase(std::unique(states.begin(), states.end()), states.end());
+	}
+
+	// Chances of fitting from `start', for one whose ways are outputs
+	// of their own, with the chances `after' them. A start shared by
+	// several states is worked out once.
+	void fit(Start& start, const std::vector<const double*>& after)
+	{
+		if (start.fits) {
+			return;
+		}
+		start.row.assign(maximum + 1, 0);
+		for (auto& w : start.ways) {
+			w.fits = after[w.state];
+			for (size_t n = 0; n + w.bytes <= maximum; n++) {
+				start.row[n] += w.weight / start.total * w.fits[n + w.bytes];
+			}
+		}
+		start.fits = start.row.data();
+	}
+
+	// One of the ways of `start' with `bytes' output so far, chosen with
+	// the chance it has and that of fitting after it. Those add up to
+	// the chance of fitting from the start, so they are worked out once.
+	size_t choose(const Start& start, size_t bytes, Rng& rng) const
+	{
+		double left = uniform(rng) * start.total * start.fits[bytes];
+		size_t last = 0;
+		for (size_t i = 0; i < start.ways.size(); i++) {
+			const Way& w = start.ways[i];
+			double c = bytes + w.bytes <= maximum ? w.weight * w.fits[bytes + w.bytes] : 0;
+			if (c > 0) {
+				if (left < c) {
+					return i;
+				}
+				left -= c;
+				last = i;
+			}
+		}
+		return last;
+	}
+
+	// One of the strings of the way `w' of `start', with its weight
+	static size_t member(const Start& start, const Way& w, Rng& rng)
+	{
+		if (w.count == 1) {
+			return start.members[w.first];
+		} else if (start.sums.empty()) {
+			return start.members[w.first + rng.choose(w.count)];
+		}
+		const double* sums = start.sums.data() + w.first;
+		size_t k = std::upper_bound(sums, sums + w.count, uniform(rng) * w.weight) - sums;
+		return start.members[w.first + (k < w.count ? k : w.count - 1)];
+	}
+};
+
+
+// The way of a leaf that outputs the `n' bytes at `s' from state `in',
+// which is `from', with `weight'.
+static Generator::Lengths::Way pass(Generator::Lengths& l, size_t in, const Generator::Match& from,
+                                    const char* s, size_t n, double weight)
+{
+	if (!from.collapsing && !from.capitalize && !from.have) {
+		// Output as it is, in the state it found
+		return {weight, n, in, nullptr, 0, 1};
+	}
+	Generator::Match m = from;
+	std::string text(s, n);
+	if (m.reversed) {
+		::reverse(text, 0);
+	}
+	feed(nullptr, m, text);
+	return {weight, m.pos, l.number(m), nullptr, 0, 1};
+}
+
+
+// Start a wrapper whose child starts in `child' from `in', and leaves
+// as `leave' turns each of its child's last states.
+template<typename F>
+static void wrap(const Generator& wrapper, const Generator& g, Generator::Lengths& l, size_t in, size_t child, F leave)
+{
+	Generator::Lengths::Start start;
+	start.ways.push_back({1, 0, child, nullptr, 0, 0});
+	start.total = 1;
+	for (size_t x : l.start(g, child).ends) {
+		Generator::Match m = l.states[x];
+		leave(m);
+		size_t y = l.number(m);
+		l.done[&wrapper][x] = std::make_pair(m.pos, y);
+		start.ends.push_back(y);
+	}
+	Generator::Lengths::unique(start.ends);
+	l.add(wrapper, in, std::move(start));
+}
+
+
+// Fit a wrapper's child, given the chances of fitting after the wrapper
+// moved back over the bytes it adds, and then the wrapper as its child
+// or, where its names are tried whole, as a leaf.
+static void fitWrapped(const Generator& wrapper, const Generator& g, Generator::Lengths& l,
+                       const std::vector<const double*>& after)
+{
+	auto& starts = l.of.at(&wrapper);
+	std::vector<const double*> inside(l.states.size(), nullptr);
+	bool wrapped = false;
+	for (auto& s : starts) {
+		if (s.second->whole) {
+			continue;
+		}
+		wrapped = true;
+		for (size_t x : l.at(&g, s.second->ways[0].state).ends) {
+			if (inside[x]) {
+				continue;
+			}
+			const std::pair<size_t, size_t>& done = l.done.at(&wrapper).at(x);
+			std::vector<double> row(l.maximum + 1);
+			for (size_t n = 0; n + done.first <= l.maximum; n++) {
+				row[n] = after[done.second][n + done.first];
+			}
+			l.rows.push_back(std::move(row));
+			inside[x] = l.rows.back().data();
+		}
+	}
+	if (wrapped) {
+		g.fit(l, inside);
+	}
+	for (auto& s : starts) {
+		Generator::Lengths::Start& start = *s.second;
+		if (start.whole) {
+			l.fit(start, after);
+		} else {
+			start.fits = l.at(&g, start.ways[0].state).fits;
+		}
+	}
+}
+
+
+void Generator::reach(Lengths& l, size_t in) const
+{
+	// Reversed, the children come out last first
+	bool reversed = l.states[in].reversed;
+	size_t k = generators.size();
+	std::vector<size_t> states(1, in);
+	std::vector<size_t> next;
+	for (size_t j = 0; j < k; j++) {
+		const Generator& g = *generators[reversed ? k - 1 - j : j];
+		next.clear();
+		for (size_t s : states) {
+			const std::vector<size_t>& ends = l.start(g, s).ends;
+			next.insert(next.end(), ends.begin(), ends.end());
+		}
+		Lengths::unique(next);
+		states.swap(next);
+	}
+	Lengths::Start start;
+	start.ends = std::move(states);
+	l.add(*this, in, std::move(start));
+}
+
+
+void Generator::fit(Lengths& l, const std::vector<const double*>& after) const
+{
+	// Children fit last first, each given the chances of those after it.
+	// Every start of a node is reversed or none is, as a Reverser of
+	// names that are not ASCII tries them whole.
+	auto& starts = l.of.at(this);
+	bool reversed = l.states[starts[0].first].reversed;
+	size_t k = generators.size();
+	std::vector<const double*> next = after;
+	for (size_t j = k; j-- > 0;) {
+		const Generator& g = *generators[reversed ? k - 1 - j : j];
+		g.fit(l, next);
+		next.assign(l.states.size(), nullptr);
+		for (auto& s : l.of.at(&g)) {
+			next[s.first] = s.second->fits;
+		}
+	}
+	for (auto& s : starts) {
+		s.second->fits = next[s.first];
+	}
+}
+
+
+void Generator::generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const
+{
+	bool reversed = l.states[state].reversed;
+	size_t k = generators.size();
+	for (size_t j = 0; j < k; j++) {
+		generators[reversed ? k - 1 - j : j]->generate(out, state, bytes, l, rng);
+	}
+}
+
+
+double Generator::chance(size_t index) const
+{
+	// Mixed radix, as nameAt() numbers names
+	double p = 1;
+	size_t radix = combos;
+	for (auto& g : generators) {
+		radix /= g->combinations();
+		p *= g->chance(index / radix);
+		index %= radix;
+	}
+	return p;
+}
+
+
+void Generator::reachWhole(Lengths& l, size_t in) const
+{
+	if (overflow) {
+		throw std::invalid_argument("Too many combinations to bound");
+	}
+	const Match from = l.states[in];
+	std::vector<Lengths::Way> each;
+	each.reserve(combos);
+	std::string name;
+	for (size_t i = 0; i < combos; i++) {
+		name.clear();
+		nameAt(name, i);
+		each.push_back(pass(l, in, from, name.data(), name.size(), chance(i)));
+	}
+	l.add(*this, in, Lengths::leaf(true, each));
+}
+
+
+void Generator::generateWhole(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const
+{
+	const Lengths::Start& start = l.at(this, state);
+	const Lengths::Way& w = start.ways[l.choose(start, bytes, rng)];
+	size_t from = out.size();
+	nameAt(out, Lengths::member(start, w, rng));
+	if (l.states[state].reversed) {
+		::reverse(out, from);
+	}
+	state = w.state;
+	bytes += w.bytes;
+}
+
+
+std::string Generator::nameAt(size_t index) const
+{
+	if (overflow) {
+		throw std::invalid_argument("Too many combinations to index");
+	} else if (index >= combos) {
+		throw std::out_of_range("Name index out of range");
+	}
+	static thread_local std::string scratch;
+	return returned(scratch, [&](std::string& out) { nameAt(out, index); });
+}
+
+
+size_t Generator::indexOf(const std::string& name) const
+{
+	if (overflow) {
+		throw std::invalid_argument("Too many combinations to index");
+	}
+	std::vector<Match> results;
+	match(name, Match{0, 0, 0, 0, false, false, false, 0, 0, 0}, results);
+	size_t index = npos;
+	for (auto& m : results) {
+		if (flush(&name, m) && m.pos == name.size() && m.index < index) {
+			index = m.index;
+		}
+	}
+	return index;
+}
+
+
+Enumeration Generator::names(size_t from) const
+{
+	if (overflow) {
+		throw std::invalid_argument("Too many combinations to enumerate");
+	}
+	return Enumeration(this, from);
+}
+
+
+void Generator::match(const std::string& name, const Match& in, std::vector<Match>& out) const
+{
+	std::vector<Match> states(1, in);
+	states[0].index = 0;
+	// Children in the order their output comes in, which is last first
+	// when reversed, each with its digit's radix
+	size_t k = generators.size();
+	size_t radix = in.reversed ? 1 : combos;
+	for (size_t j = 0; j < k; j++) {
+		const std::unique_ptr<Generator>& g = generators[in.reversed ? k - 1 - j : j];
+		if (!in.reversed) {
+			radix /= g->combinations();
+		}
+		std::vector<Match> next;
+		std::vector<Match> results;
+		for (auto& state : states) {
+			results.clear();
+			g->match(name, state, results);
+			for (auto m : results) {
+				m.index = state.index + m.index * radix;
+				keep(next, m);
+			}
+		}
+		states.swap(next);
+		if (in.reversed) {
+			radix *= g->combinations();
+		}
+	}
+	for (auto& m : states) {
+		keep(out, m);
+	}
+}
+
+
+// Match by trying every name this node produces, for wrappers whose
+// effect cannot be followed character by character.
+void Generator::matchEach(const std::string& name, const Match& in, std::vector<Match>& out) const
+{
+	std::string str;
+	for (size_t i = 0; i < combos; i++) {
+		str.clear();
+		nameAt(str, i);
+		if (in.reversed) {
+			::reverse(str, 0);
+		}
+		Match m = in;
+		m.index = i;
+		if (feed(&name, m, str)) {
+			keep(out, m);
+		}
+	}
+}
+
+
+void Generator::nameAt(std::string& out, size_t index) const
+{
+	// Mixed radix, with the last child as the least significant digit
+	size_t radix = combos;
+	for (auto& g : generators) {
+		radix /= g->combinations();
+		g->nameAt(out, index / radix);
+		index %= radix;
+	}
+}
+
+
+void Generator::generate(std::string& out, Rng& rng) const
+{
+	for (auto& g : generators) {
+		g->generate(out, rng);
+	}
+}
+
+
+size_t Generator::generate(char* dst, size_t len, Rng& rng) const noexcept
+{
+	static thread_local std::string scratch;
+	try {
+		copied(scratch, [&](std::string& out) { generate(out, rng); });
+	} catch (...) {
+		scratch.clear();
+	}
+	return copy(scratch, dst, len);
+}
+
+
+size_t Generator::memory() const
+{
+	size_t total = sizeof(*this) + generators.capacity() * sizeof(generators[0]);
+	for (auto& g : generators) {
+		total += g->memory();
+	}
+	return total;
+}
+
+
+const Generator* Generator::core() const
+{
+	const Generator* g = this;
+	while (g->generators.size() == 1 &&
+	       (typeid(*g) == typeid(Generator) || typeid(*g) == typeid(Sequence))) {
+		g = g->generators[0].get();
+	}
+	return g;
+}
+
+
+size_t Generator::nodes() const
+{
+	size_t total = 1;
+	for (auto& g : generators) {
+		total += g->nodes();
+	}
+	return total;
+}
+
+
+const char* Generator::type() const
+{
+	return "Generator";
+}
+
+
+Generator::Profile Generator::profile() const
+{
+	Profile p{0, 0, memory(), 0, {}};
+	account(p, 1);
+	return p;
+}
+
+
+void Generator::account(Profile& p, size_t depth) const
+{
+	p.nodes++;
+	p.types[type()]++;
+	if (depth > p.depth) {
+		p.depth = depth;
+	}
+	// Each child is its own block, and so is the vector holding them
+	p.allocations += generators.size() + (generators.capacity() ? 1 : 0);
+	for (auto& g : generators) {
+		g->account(p, depth + 1);
+	}
+}
+
+
+std::unique_ptr<Generator> Generator::optimized(std::unique_ptr<Generator>&& g)
+{
+	std::unique_ptr<Generator> o = g->optimize();
+	return o ? std::move(o) : std::move(g);
+}
+
+
+std::unique_ptr<Generator> Generator::optimize()
+{
+	// Children as one sequence, with nested sequences flattened and
+	// adjacent literals joined. The text of a run of literals is
+	// gathered in `run' and made into one Literal when the run ends.
+	std::vector<std::unique_ptr<Generator>> children;
+	std::string run;
+	auto join = [&]() {
+		if (!run.empty()) {
+			children.back() = make_unique<Literal>(run);
+			run.clear();
+		}
+	};
+	for (auto& child : generators) {
+		std::vector<std::unique_ptr<Generator>> parts;
+		child = optimized(std::move(child));
+		if (dynamic_cast<Sequence*>(child.get())) {
+			parts = std::move(child->generators);
+		} else {
+			parts.push_back(std::move(child));
+		}
+		for (auto& part : parts) {
+			auto* literal = dynamic_cast<Literal*>(part.get());
+			auto* last = children.empty() ? nullptr : dynamic_cast<Literal*>(children.back().get());
+			if (literal && literal->text().empty()) {
+				continue;
+			} else if (literal && last) {
+				if (run.empty()) {
+					run = last->text();
+				}
+				run += literal->text();
+			} else {
+				join();
+				children.push_back(std::move(part));
+			}
+		}
+	}
+	join();
+	generators.clear();
+
+	switch (children.size()) {
+		case 0:
+			return make_unique<Literal>("");
+		case 1:
+			return std::move(children[0]);
+		default:
+			return make_unique<Sequence>(std::move(children));
+	}
+}
+
+
+std::unique_ptr<Generator> Generator::transform(void (*)(std::string&, size_t)) const
+{
+	return nullptr;
+}
+
+
+void Generator::compile(Program& program) const
+{
+	for (auto& g : generators) {
+		g->compile(program);
+	}
+}
+
+
+void Generator::add(std::unique_ptr<Generator>&& g)
+{
+	generators.push_back(std::move(g));
+	include(*generators.back());
+}
+
+
+Bounded::Bounded(const Generator& generator_, size_t minLen, size_t maxLen) :
+	generator(generator_)
+{
+	if (minLen > maxLen) {
+		throw std::invalid_argument("Minimum length above the maximum");
+	}
+
+	// A capital takes at most one byte more than the two or more it
+	// replaces, so no name is longer than that
+	size_t longest = generator.max() + (generator.resizes() ? generator.max() / 2 : 0);
+	auto l = std::make_shared<Generator::Lengths>(maxLen < longest ? maxLen : longest);
+	if (minLen > l->maximum) {
+		throw std::invalid_argument("No name fits the lengths");
+	}
+	size_t in = l->number(Generator::Match{0, 0, 0, 0, false, 0, false, 0, 0, 0});
+	const Generator::Lengths::Start& start = l->start(generator, in);
+
+	// A name ends with whatever is left of a character cut short
+	std::vector<const double*> after(l->states.size(), nullptr);
+	for (size_t x : start.ends) {
+		Generator::Match m = l->states[x];
+		flush(nullptr, m);
+		std::vector<double> row(l->maximum + 1);
+		for (size_t n = 0; n <= l->maximum; n++) {
+			row[n] = n + m.pos >= minLen && n + m.pos <= l->maximum;
+		}
+		l->rows.push_back(std::move(row));
+		after[x] = l->rows.back().data();
+	}
+	generator.fit(*l, after);
+	if (!(start.fits[0] > 0)) {
+		throw std::invalid_argument("No name fits the lengths");
+	}
+	lengths = std::move(l);
+}
+
+void Bounded::generate(std::string& out, Rng& rng) const
+{
+	size_t state = 0;
+	size_t bytes = 0;
+	generator.generate(out, state, bytes, *lengths, rng);
+}
+
+std::string Bounded::toString(Rng& rng) const
+{
+	static thread_local std::string scratch;
+	return returned(scratch, [&](std::string& out) { generate(out, rng); });
+}
+
+void Bounded::generate(std::string& out) const
+{
+	generate(out, defaultRng());
+}
+
+std::string Bounded::toString() const
+{
+	return toString(defaultRng());
+}
+
+
+Enumeration::Enumeration(const Generator* generator_, size_t first_) :
+	generator(generator_),
+	first(first_)
+{
+}
+
+Enumeration::iterator Enumeration::begin() const
+{
+	return iterator(generator, first);
+}
+
+Enumeration::iterator Enumeration::end() const
+{
+	return iterator(generator, generator->combinations());
+}
+
+Enumeration::iterator::iterator(const Generator* generator_, size_t index_) :
+	generator(generator_),
+	index(index_)
+{
+	if (index < generator->combinations()) {
+		generator->nameAt(name, index);
+	} else {
+		index = generator->combinations();
+	}
+}
+
+const std::string& Enumeration::iterator::operator*() const
+{
+	return name;
+}
+
+const std::string* Enumeration::iterator::operator->() const
+{
+	return &name;
+}
+
+Enumeration::iterator& Enumeration::iterator::operator++()
+{
+	name.clear();
+	if (++index < generator->combinations()) {
+		generator->nameAt(name, index);
+	}
+	return *this;
+}
+
+bool Enumeration::iterator::operator==(const iterator& other) const
+{
+	return index == other.index;
+}
+
+bool Enumeration::iterator::operator!=(const iterator& other) const
+{
+	return index != other.index;
+}
+
+size_t Enumeration::iterator::position() const
+{
+	return index;
+}
+
+
+Random::Random()
+{
+	shortest = -1;
+}
+
+Random::Random(std::vector<std::unique_ptr<Generator>>&& generators_)
+{
+	shortest = -1;
+	for (auto& g : generators_) {
+		add(std::move(g));
+	}
+}
+
+Random::Random(std::vector<std::unique_ptr<Generator>>&& generators_, const std::vector<size_t>& weights_) :
+	weights(weights_)
+{
+	shortest = -1;
+	for (auto& g : generators_) {
+		add(std::move(g));
+	}
+	double lengths = 0, total = 0;
+	for (size_t i = 0; i < weights.size(); i++) {
+		lengths += double(weights[i]) * generators[i]->mean();
+		total += weights[i];
+	}
+	if (total) {
+		expected = lengths / total;
+	}
+	for (auto w : weights) {
+		if (w != 1) {
+			alias = std::make_shared<Alias>(weights);
+			return;
+		}
+	}
+	weights.clear();
+}
+
+void Random::include(const Generator& g)
+{
+	size_t n = g.combinations();
+	if (generators.size() == 1) {
+		// Until its first child, an empty Random counts as one name
+		combos = 0;
+	}
+	if (!weights.empty()) {
+		overflow |= mul_overflow(n, weights[generators.size() - 1], n);
+	}
+	overflow |= g.overflows() | add_overflow(combos, n, combos);
+	ascii &= g.isAscii();
+	shrinking |= g.shrinks();
+	resizing |= g.resizes();
+	if (g.min() < shortest) {
+		shortest = g.min();
+	}
+	if (g.max() > longest) {
+		longest = g.max();
+	}
+	// Weighted alternatives are averaged again once all are added
+	expected += (g.mean() - expected) / generators.size();
+}
+
+
+void Random::generate(std::string& out, Rng& rng) const
+{
+	if (!generators.size()) {
+		return;
+	} else if (alias) {
+		generators[alias->choose(rng)]->generate(out, rng);
+	} else {
+		generators[rng.choose(generators.size())]->generate(out, rng);
+	}
+}
+
+
+double Random::chance(size_t index) const
+{
+	// A weighted alternative numbers each of its names as many times
+	// as its weight
+	double total = alias ? alias->total() : generators.size();
+	for (size_t i = 0; i < generators.size(); i++) {
+		const Generator& g = *generators[i];
+		size_t n = g.combinations() * (alias ? alias->weight(i) : 1);
+		if (index < n) {
+			return g.chance(index % g.combinations()) / total;
+		}
+		index -= n;
+	}
+	return 1;
+}
+
+void Random::reach(Lengths& l, size_t in) const
+{
+	Lengths::Start start;
+	if (generators.empty()) {
+		start.ends.push_back(in);
+	}
+	for (size_t i = 0; i < generators.size(); i++) {
+		const std::vector<size_t>& ends = l.start(*generators[i], in).ends;
+		start.ends.insert(start.ends.end(), ends.begin(), ends.end());
+		start.ways.push_back({double(weights.empty() ? 1 : weights[i]), 0, in, nullptr, 0, 0});
+		start.total += start.ways.back().weight;
+	}
+	Lengths::unique(start.ends);
+	l.add(*this, in, std::move(start));
+}
+
+void Random::fit(Lengths& l, const std::vector<const double*>& after) const
+{
+	// Alternatives start where the choice does, and fit as it would
+	for (auto& g : generators) {
+		g->fit(l, after);
+	}
+	for (auto& s : l.of.at(this)) {
+		Lengths::Start& start = *s.second;
+		if (generators.empty()) {
+			start.fits = after[s.first];
+			continue;
+		}
+		start.row.assign(l.maximum + 1, 0);
+		for (size_t i = 0; i < generators.size(); i++) {
+			Lengths::Way& w = start.ways[i];
+			w.fits = l.at(generators[i].get(), s.first).fits;
+			for (size_t n = 0; n <= l.maximum; n++) {
+				start.row[n] += w.weight / start.total * w.fits[n];
+			}
+		}
+		start.fits = start.row.data();
+	}
+}
+
+void Random::generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const
+{
+	if (generators.empty()) {
+		return;
+	}
+	size_t i = l.choose(l.at(this, state), bytes, rng);
+	generators[i]->generate(out, state, bytes, l, rng);
+}
+
+
+std::unique_ptr<Generator> Random::optimize()
+{
+	if (generators.empty()) {
+		return nullptr;
+	}
+	std::vector<std::string> strings;
+	for (auto& g : generators) {
+		g = optimized(std::move(g));
+		if (auto* literal = dynamic_cast<Literal*>(g.get())) {
+			strings.push_back(literal->text());
+		}
+	}
+	if (generators.size() == 1 && !alias) {
+		return std::move(generators[0]);
+	} else if (strings.size() == generators.size()) {
+		return Table::Pack(strings, alias);
+	}
+	return make_unique<Random>(std::move(generators), weights);
+}
+
+size_t Random::memory() const
+{
+	size_t total = Generator::memory() + sizeof(*this) - sizeof(Generator) +
+	               weights.capacity() * sizeof(weights[0]);
+	if (alias) {
+		total += alias->memory();
+	}
+	return total;
+}
+
+
+void Random::account(Profile& p, size_t depth) const
+{
+	Generator::account(p, depth);
+	p.allocations += weights.capacity() ? 1 : 0;
+	if (alias) {
+		p.allocations += alias->allocations();
+	}
+}
+
+const char* Random::type() const
+{
+	return "Random";
+}
+
+
+void Random::compile(Program& program) const
+{
+	if (!generators.size()) {
+		return;
+	} else if (generators.size() == 1) {
+		// Weighted, or it would have been optimized away; no choice
+		generators[0]->compile(program);
+		return;
+	}
+	if (alias) {
+		program.emit(Program::weighted_random);
+		program.emit(generators.size());
+		alias->compile(program);
+	} else {
+		program.emit(Program::random);
+		program.emit(generators.size());
+	}
+	size_t targets = program.size();
+	for (size_t i = 0; i < generators.size(); i++) {
+		program.emit(0);
+	}
+	std::vector<size_t> jumps;
+	for (size_t i = 0; i < generators.size(); i++) {
+		program.patch(targets + i, program.size());
+		generators[i]->compile(program);
+		if (i + 1 < generators.size()) {
+			program.emit(Program::jump);
+			jumps.push_back(program.size());
+			program.emit(0);
+		}
+	}
+	for (auto at : jumps) {
+		program.patch(at, program.size());
+	}
+}
+
+
+Sequence::Sequence()
+{
+}
+
+Sequence::Sequence(std::vector<std::unique_ptr<Generator>>&& generators_) :
+	Generator(std::move(generators_))
+{
+}
+
+const char* Sequence::type() const
+{
+	return "Sequence";
+}
+
+Literal::Literal(const std::string &value_) :
+	value(value_)
+{
+	shortest = longest = value.size();
+	expected = value.size();
+	for (unsigned char c : value) {
+		ascii &= c < 0x80;
+	}
+}
+
+const std::string& Literal::text() const
+{
+	return value;
+}
+
+std::unique_ptr<Generator> Literal::optimize()
+{
+	return nullptr;
+}
+
+std::unique_ptr<Generator> Literal::transform(void (*f)(std::string&, size_t)) const
+{
+	std::string s = value;
+	f(s, 0);
+	return make_unique<Literal>(s);
+}
+
+void Random::nameAt(std::string& out, size_t index) const
+{
+	for (size_t i = 0; i < generators.size(); i++) {
+		const Generator& g = *generators[i];
+		size_t n = g.combinations() * (alias ? alias->weight(i) : 1);
+		if (index < n) {
+			g.nameAt(out, index % g.combinations());
+			return;
+		}
+		index -= n;
+	}
+}
+
+
+void Random::match(const std::string& name, const Match& in, std::vector<Match>& out) const
+{
+	size_t offset = 0;
+	std::vector<Match> results;
+	for (size_t i = 0; i < generators.size(); i++) {
+		const Generator& g = *generators[i];
+		results.clear();
+		g.match(name, in, results);
+		for (auto m : results) {
+			m.index += offset;
+			keep(out, m);
+		}
+		offset += g.combinations() * (alias ? alias->weight(i) : 1);
+	}
+	if (generators.empty()) {
+		Match m = in;
+		m.index = 0;
+		keep(out, m);
+	}
+}
+
+
+void Literal::match(const std::string& name, const Match& in, std::vector<Match>& out) const
+{
+	Match m = in;
+	m.index = 0;
+	std::string reversed;
+	if (in.reversed) {
+		reversed = value;
+		::reverse(reversed, 0);
+	}
+	if (feed(&name, m, in.reversed ? reversed : value)) {
+		keep(out, m);
+	}
+}
+
+void Literal::nameAt(std::string& out, size_t) const
+{
+	out.append(value);
+}
+
+void Literal::reach(Lengths& l, size_t in) const
+{
+	unsigned char c = value.empty() ? 0x80 : value[0];
+	if (!l.share(*this, in, [&](uint32_t last) { return c < 0x80 && c != last; })) {
+		l.add(*this, in, Lengths::leaf(false, {pass(l, in, l.states[in], value.data(), value.size(), 1)}));
+	}
+}
+
+void Literal::fit(Lengths& l, const std::vector<const double*>& after) const
+{
+	for (auto& s : l.of.at(this)) {
+		l.fit(*s.second, after);
+	}
+}
+
+void Literal::generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng&) const
+{
+	const Lengths::Way& w = l.at(this, state).ways[0];
+	size_t from = out.size();
+	out.append(value);
+	if (l.states[state].reversed) {
+		::reverse(out, from);
+	}
+	state = w.state;
+	bytes += w.bytes;
+}
+
+void Literal::generate(std::string& out, Rng&) const
+{
+	out.append(value);
+}
+
+void Literal::compile(Program& program) const
+{
+	program.emit(value);
+}
+
+size_t Literal::memory() const
+{
+	size_t total = Generator::memory() + sizeof(*this) - sizeof(Generator);
+	if (Counter::allocated(value)) {
+		total += Counter::block(value);
+	}
+	return total;
+}
+
+void Literal::account(Profile& p, size_t depth) const
+{
+	Generator::account(p, depth);
+	p.allocations += Counter::allocated(value);
+}
+
+const char* Literal::type() const
+{
+	return "Literal";
+}
+
+Table::Table(const std::shared_ptr<const Batch>& strings_, size_t first_, size_t count_,
+             const std::shared_ptr<const Alias>& alias_) :
+	strings(strings_),
+	first(first_),
+	count(count_),
+	alias(alias_)
+{
+	if (count) {
+		combos = alias ? alias->total() : count;
+		shortest = -1;
+	}
+	for (size_t i = first; i < first + count; i++) {
+		size_t length = strings->length(i);
+		for (size_t j = 0; j < length; j++) {
+			ascii &= (unsigned char)(*strings)[i][j] < 0x80;
+		}
+		if (length < shortest) {
+			shortest = length;
+		}
+		if (length > longest) {
+			longest = length;
+		}
+		expected += double(length) * (alias ? alias->weight(i - first) : 1);
+	}
+	if (combos) {
+		expected /= combos;
+	}
+}
+
+namespace {
+
+// All symbol strings and every single byte packed into one Batch, with
+// where each symbol's range starts and ends, built once per process.
+struct SymbolTables {
+	std::shared_ptr<Batch> strings;
+	uint16_t first[128];
+	uint16_t last[128];
+	uint16_t chars;
+
+	// The same strings packed as in a Program, for every Program to
+	// share: string i runs from index[i] to index[i + 1] in the pool.
+	std::string pool;
+	std::vector<uint32_t> index;
+
+	SymbolTables() :
+		strings(std::make_shared<Batch>()),
+		first(),
+		last()
+	{
+		chars = strings->size();
+		for (int c = 0; c < 256; c++) {
+			strings->arena.push_back(c);
+			strings->arena.push_back('\0');
+			strings->offsets.push_back(strings->arena.size());
+		}
+		for (auto& symbol : Symbols::all) {
+			unsigned char c = symbol.symbol;
+			first[c] = strings->size();
+			for (size_t i = 0; i < symbol.count; i++) {
+				strings->arena.append(symbol.strings[i]);
+				strings->arena.push_back('\0');
+				strings->offsets.push_back(strings->arena.size());
+			}
+			last[c] = strings->size();
+		}
+		for (size_t i = 0; i < strings->size(); i++) {
+			index.push_back(pool.size());
+			pool.append((*strings)[i], strings->length(i));
+		}
+		index.push_back(pool.size());
+	}
+};
+
+}
+
+static const SymbolTables& symbolTables()
+{
+	static const SymbolTables* const tables = new SymbolTables();
+	return *tables;
+}
+
+std::unique_ptr<Table> Table::Symbol(char c)
+{
+	const SymbolTables& s = symbolTables();
+	unsigned char i = c;
+	if (i >= 128 || s.first[i] == s.last[i]) {
+		return nullptr;
+	}
+	return make_unique<Table>(s.strings, s.first[i], s.last[i] - s.first[i]);
+}
+
+std::unique_ptr<Table> Table::Character(char c)
+{
+	const SymbolTables& s = symbolTables();
+	return make_unique<Table>(s.strings, s.chars + (unsigned char)c, 1);
+}
+
+void Table::generate(std::string& out, Rng& rng) const
+{
+	if (count) {
+		size_t i = first + (alias ? alias->choose(rng) : rng.choose(count));
+		out.append((*strings)[i], strings->length(i));
+	}
+}
+
+double Table::chance(size_t) const
+{
+	return count ? 1.0 / (alias ? alias->total() : count) : 1;
+}
+
+void Table::reach(Lengths& l, size_t in) const
+{
+	bool shared = l.share(*this, in, [&](uint32_t last) {
+		for (size_t i = 0; i < count; i++) {
+			unsigned char c = strings->length(first + i) ? (*strings)[first + i][0] : 0x80;
+			if (c >= 0x80 || c == last) {
+				return false;
+			}
+		}
+		return count > 0;
+	});
+	if (shared) {
+		return;
+	}
+	const Match from = l.states[in];
+	std::vector<Lengths::Way> each;
+	each.reserve(count ? count : 1);
+	if (!count) {
+		each.push_back(pass(l, in, from, "", 0, 1));
+	}
+	for (size_t i = 0; i < count; i++) {
+		each.push_back(pass(l, in, from, (*strings)[first + i], strings->length(first + i), alias ? alias->weight(i) : 1));
+	}
+	l.add(*this, in, Lengths::leaf(false, each));
+}
+
+void Table::fit(Lengths& l, const std::vector<const double*>& after) const
+{
+	for (auto& s : l.of.at(this)) {
+		l.fit(*s.second, after);
+	}
+}
+
+void Table::generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const
+{
+	const Lengths::Start& start = l.at(this, state);
+	const Lengths::Way& w = start.ways[l.choose(start, bytes, rng)];
+	if (count) {
+		size_t i = first + Lengths::member(start, w, rng);
+		size_t from = out.size();
+		out.append((*strings)[i], strings->length(i));
+		if (l.states[state].reversed) {
+			::reverse(out, from);
+		}
+	}
+	state = w.state;
+	bytes += w.bytes;
+}
+
+void Table::nameAt(std::string& out, size_t index) const
+{
+	if (count) {
+		size_t i = first + (alias ? alias->find(index) : index);
+		out.append((*strings)[i], strings->length(i));
+	}
+}
+
+void Table::match(const std::string& name, const Match& in, std::vector<Match>& out) const
+{
+	std::string value;
+	size_t n = count ? count : 1;
+	for (size_t i = 0; i < n; i++) {
+		Match m = in;
+		m.index = alias ? alias->start(i) : i;
+		value.clear();
+		if (count) {
+			value.assign((*strings)[first + i], strings->length(first + i));
+		}
+		if (in.reversed) {
+			::reverse(value, 0);
+		}
+		if (feed(&name, m, value)) {
+			keep(out, m);
+		}
+	}
+}
+
+void Table::compile(Program& program) const
+{
+	if (count == 1 && alias) {
+		program.emit(std::string((*strings)[first], strings->length(first)));
+	} else if (count) {
+		program.emit(strings, first, count, alias.get());
+	}
+}
+
+size_t Table::memory() const
+{
+	size_t total = Generator::memory() + sizeof(*this) - sizeof(Generator);
+	if (strings.use_count() == 1) {
+		total += sizeof(Batch) + strings->arena.capacity() +
+		         strings->offsets.capacity() * sizeof(strings->offsets[0]);
+	}
+	if (alias.use_count() == 1) {
+		total += alias->memory();
+	}
+	return total;
+}
+
+void Table::account(Profile& p, size_t depth) const
+{
+	Generator::account(p, depth);
+	if (strings.use_count() == 1) {
+		p.allocations += 1 + Counter::allocated(strings->arena) + Counter::allocated(strings->offsets);
+	}
+	if (alias.use_count() == 1) {
+		p.allocations += alias->allocations();
+	}
+}
+
+const char* Table::type() const
+{
+	return "Table";
+}
+
+std::unique_ptr<Table> Table::Pack(const std::vector<std::string>& values,
+                                   const std::shared_ptr<const Alias>& alias)
+{
+	auto strings = std::make_shared<Batch>();
+	for (auto& s : values) {
+		strings->arena.append(s);
+		strings->arena.push_back('\0');
+		strings->offsets.push_back(strings->arena.size());
+	}
+	return make_unique<Table>(strings, 0, values.size(), alias);
+}
+
+std::unique_ptr<Generator> Table::optimize()
+{
+	if (count > 1 || alias) {
+		return nullptr;
+	}
+	std::string value;
+	nameAt(value, 0);
+	return make_unique<Literal>(value);
+}
+
+std::unique_ptr<Generator> Table::transform(void (*f)(std::string&, size_t)) const
+{
+	std::vector<std::string> values(count);
+	for (size_t i = 0; i < count; i++) {
+		values[i].assign((*strings)[first + i], strings->length(first + i));
+		f(values[i], 0);
+	}
+	return Pack(values, alias);
+}
+
+Reverser::Reverser(std::unique_ptr<Generator>&& g)
+{
+	add(std::move(g));
+}
+
+
+void Reverser::generate(std::string& out, Rng& rng) const
+{
+	size_t from = out.size();
+	Generator::generate(out, rng);
+	reverse(out, from);
+}
+
+void Reverser::reach(Lengths& l, size_t in) const
+{
+	// As in match(), the child is followed last part first, its output
+	// coming out as it is
+	if (!ascii) {
+		reachWhole(l, in);
+		return;
+	}
+	Match m = l.states[in];
+	m.reversed = !m.reversed;
+	wrap(*this, *generators[0], l, in, l.number(m), [](Match& m) { m.reversed = !m.reversed; });
+}
+
+void Reverser::fit(Lengths& l, const std::vector<const double*>& after) const
+{
+	fitWrapped(*this, *generators[0], l, after);
+}
+
+void Reverser::generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const
+{
+	const Lengths::Start& start = l.at(this, state);
+	if (start.whole) {
+		generateWhole(out, state, bytes, l, rng);
+		return;
+	}
+	state = start.ways[0].state;
+	generators[0]->generate(out, state, bytes, l, rng);
+	const std::pair<size_t, size_t>& done = l.done.at(this).at(state);
+	bytes += done.first;
+	state = done.second;
+}
+
+void Reverser::nameAt(std::string& out, size_t index) const
+{
+	size_t from = out.size();
+	Generator::nameAt(out, index);
+	reverse(out, from);
+}
+
+void Reverser::match(const std::string& name, const Match& in, std::vector<Match>& out) const
+{
+	// Reversed output is matched by matching the parts of the child's
+	// last first, each reversed in turn. That takes every character to
+	// lie within a part, which holds for sure only for ASCII; otherwise
+	// every name of the child is tried.
+	if (!ascii) {
+		matchEach(name, in, out);
+		return;
+	}
+	Match m = in;
+	m.reversed = !in.reversed;
+	std::vector<Match> results;
+	Generator::match(name, m, results);
+	for (auto& r : results) {
+		r.reversed = in.reversed;
+		keep(out, r);
+	}
+}
+
+const char* Reverser::type() const
+{
+	return "Reverser";
+}
+
+void Reverser::compile(Program& program) const
+{
+	program.open();
+	Generator::compile(program);
+	program.close(Program::reverse);
+}
+
+std::unique_ptr<Generator> Reverser::optimize()
+{
+	std::unique_ptr<Generator> g = Generator::optimize();
+	std::unique_ptr<Generator> folded = g->transform(::reverse);
+	return folded ? std::move(folded) : make_unique<Reverser>(std::move(g));
+}
+
+Capitalizer::Capitalizer(std::unique_ptr<Generator>&& g)
+{
+	add(std::move(g));
+	// Capitals may take more or fewer bytes outside ASCII
+	resizing |= !ascii;
+}
+
+void Capitalizer::generate(std::string& out, Rng& rng) const
+{
+	size_t from = out.size();
+	Generator::generate(out, rng);
+	capitalize(out, from);
+}
+
+void Capitalizer::reach(Lengths& l, size_t in) const
+{
+	// As in match(), but counting the Capitalizers still waiting for
+	// their character rather than restoring them
+	if (l.states[in].reversed || l.states[in].have) {
+		reachWhole(l, in);
+		return;
+	}
+	Match m = l.states[in];
+	m.capitalize++;
+	wrap(*this, *generators[0], l, in, l.number(m), [](Match& m) {
+		int waiting = m.capitalize;
+		if (waiting) {
+			flush(nullptr, m);
+			m.capitalize = waiting - 1;
+		}
+	});
+}
+
+void Capitalizer::fit(Lengths& l, const std::vector<const double*>& after) const
+{
+	fitWrapped(*this, *generators[0], l, after);
+}
+
+void Capitalizer::generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const
+{
+	const Lengths::Start& start = l.at(this, state);
+	if (start.whole) {
+		generateWhole(out, state, bytes, l, rng);
+		return;
+	}
+	size_t from = out.size();
+	state = start.ways[0].state;
+	generators[0]->generate(out, state, bytes, l, rng);
+	const std::pair<size_t, size_t>& done = l.done.at(this).at(state);
+	bytes += done.first;
+	state = done.second;
+	capitalize(out, from);
+}
+
+void Capitalizer::nameAt(std::string& out, size_t index) const
+{
+	size_t from = out.size();
+	Generator::nameAt(out, index);
+	capitalize(out, from);
+}
+
+void Capitalizer::match(const std::string& name, const Match& in, std::vector<Match>& out) const
+{
+	if (in.reversed) {
+		// The character capitalized comes last
+		matchEach(name, in, out);
+		return;
+	}
+	Match m = in;
+	m.capitalize = true;
+	std::vector<Match> results;
+	Generator::match(name, m, results);
+	for (auto& r : results) {
+		// A character cut short by the end of the output is not
+		// capitalized; if nothing was produced at all, an outer
+		// Capitalizer is still waiting for its character.
+		if (r.capitalize && r.have && !flush(&name, r)) {
+			continue;
+		}
+		if (r.capitalize) {
+			r.capitalize = in.capitalize;
+		}
+		keep(out, r);
+	}
+}
+
+const char* Capitalizer::type() const
+{
+	return "Capitalizer";
+}
+
+void Capitalizer::compile(Program& program) const
+{
+	program.open();
+	Generator::compile(program);
+	program.close(Program::capitalize);
+}
+
+std::unique_ptr<Generator> Capitalizer::optimize()
+{
+	std::unique_ptr<Generator> g = Generator::optimize();
+	std::unique_ptr<Generator> folded = g->transform(::capitalize);
+	return folded ? std::move(folded) : make_unique<Capitalizer>(std::move(g));
+}
+
+
+Collapser::Collapser(std::unique_ptr<Generator>&& g)
+{
+	add(std::move(g));
+	shrinking = true;
+}
+
+void Collapser::generate(std::string& out, Rng& rng) const
+{
+	size_t from = out.size();
+	Generator::generate(out, rng);
+	collapse(out, from);
+}
+
+void Collapser::reach(Lengths& l, size_t in) const
+{
+	const Match& m = l.states[in];
+	if (m.collapsing || m.capitalize || m.have) {
+		reachWhole(l, in);
+		return;
+	}
+	Match c = m;
+	c.collapsing = true;
+	c.pch = 0;
+	c.cnt = 0;
+	wrap(*this, *generators[0], l, in, l.number(c), [](Match& m) {
+		flush(nullptr, m);
+		m.collapsing = false;
+		m.pch = 0;
+		m.cnt = 0;
+	});
+}
+
+void Collapser::fit(Lengths& l, const std::vector<const double*>& after) const
+{
+	fitWrapped(*this, *generators[0], l, after);
+}
+
+void Collapser::generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const
+{
+	const Lengths::Start& start = l.at(this, state);
+	if (start.whole) {
+		generateWhole(out, state, bytes, l, rng);
+		return;
+	}
+	size_t from = out.size();
+	state = start.ways[0].state;
+	generators[0]->generate(out, state, bytes, l, rng);
+	const std::pair<size_t, size_t>& done = l.done.at(this).at(state);
+	bytes += done.first;
+	state = done.second;
+	collapse(out, from);
+}
+
+void Collapser::nameAt(std::string& out, size_t index) const
+{
+	size_t from = out.size();
+	Generator::nameAt(out, index);
+	collapse(out, from);
+}
+
+void Collapser::match(const std::string& name, const Match& in, std::vector<Match>& out) const
+{
+	if (in.collapsing || in.capitalize) {
+		matchEach(name, in, out);
+		return;
+	}
+	Match m = in;
+	m.collapsing = true;
+	m.pch = 0;
+	m.cnt = 0;
+	std::vector<Match> results;
+	Generator::match(name, m, results);
+	for (auto& r : results) {
+		if (!flush(&name, r)) {
+			continue;
+		}
+		r.collapsing = false;
+		r.pch = 0;
+		r.cnt = 0;
+		keep(out, r);
+	}
+}
+
+const char* Collapser::type() const
+{
+	return "Collapser";
+}
+
+void Collapser::compile(Program& program) const
+{
+	if (program.defer(*this)) {
+		Generator::compile(program);
+		return;
+	}
+	program.open();
+	Generator::compile(program);
+	program.close(Program::collapse);
+}
+
+std::unique_ptr<Generator> Collapser::optimize()
+{
+	std::unique_ptr<Generator> g = Generator::optimize();
+	std::unique_ptr<Generator> folded = g->transform(::collapse);
+	return folded ? std::move(folded) : make_unique<Collapser>(std::move(g));
+}
+
+
+// Length of the weight "^N" at pattern[at], which goes in `weight'. A
+// caret only ever starts a weight, so one with no number after it, or
+// not at the end of its alternative, is an error.
+static size_t weight(const std::string& pattern, size_t at, size_t& weight)
+{
+	size_t end = at + 1;
+	uint64_t value = 0;
+	while (end < pattern.size() && pattern[end] >= '0' && pattern[end] <= '9') {
+		value = value * 10 + (pattern[end++] - '0');
+		if (value > UINT32_MAX) {
+			value = UINT32_MAX + uint64_t(1);
+		}
+	}
+	char next = end < pattern.size() ? pattern[end] : '|';
+	if (end == at + 1) {
+		throw std::invalid_argument("Missing weight after '^' in pattern");
+	} else if (next != '|' && next != ')' && next != '>') {
+		throw std::invalid_argument("Weight not at the end of an alternative in pattern");
+	} else if (!value) {
+		throw std::invalid_argument("Zero weight in pattern");
+	} else if (value > UINT32_MAX) {
+		throw std::invalid_argument("Weight too large in pattern");
+	}
+	weight = value;
+	return end - at;
+}
+
+Generator::Generator(const std::string &pattern, bool collapse_triples, bool optimize_tree) {
+	std::unique_ptr<Generator> last;
+	size_t w = 0;
+
+	// Groups are kept by value, so opening one costs no allocation
+	std::vector<Group> stack;
+	stack.reserve(16);
+	stack.emplace_back(group_types::symbol, 0);
+
+	for (size_t i = 0; i < pattern.size(); i++) {
+		char c = pattern[i];
+		Group& top = stack.back();
+		switch (c) {
+			case '<':
+				stack.emplace_back(group_types::symbol, i + 1);
+				break;
+			case '(':
+				stack.emplace_back(group_types::literal, i + 1);
+				break;
+			case '>':
+			case ')':
+				if (stack.size() == 1) {
+					throw std::invalid_argument("Unbalanced brackets");
+				} else if (c == '>' && top.type != group_types::symbol) {
+					throw std::invalid_argument("Unexpected '>' in pattern");
+				} else if (c == ')' && top.type != group_types::literal) {
+					throw std::invalid_argument("Unexpected ')' in pattern");
+				}
+				last = top.produce(pattern, i);
+				stack.pop_back();
+				stack.back().add(std::move(last));
+				break;
+			case '|':
+				top.split(i);
+				break;
+			case '^': {
+				size_t length = weight(pattern, i, w);
+				top.weigh(i, w);
+				i += length - 1;
+				break;
+			}
+			case '!':
+				if (top.type == group_types::symbol) {
+					top.wrap(wrappers::capitalizer);
+				} else {
+					top.add(c);
+				}
+				break;
+			case '~':
+				if (top.type == group_types::symbol) {
+					top.wrap(wrappers::reverser);
+				} else {
+					top.add(c);
+				}
+				break;
+			default:
+				top.add(c);
+				break;
+		}
+	}
+
+	if (stack.size() != 1) {
+		throw std::invalid_argument("Missing closing bracket");
+	}
+
+	std::unique_ptr<Generator> g = stack.back().produce(pattern, pattern.size());
+	if (collapse_triples) {
+		g = make_unique<Collapser>(std::move(g));
+	}
+	if (optimize_tree) {
+		g = optimized(std::move(g));
+	}
+	add(std::move(g));
+}
+
+
+Generator::Group::Group(group_types_t type_, size_t start_) :
+	start(start_),
+	type(type_)
+{
+}
+
+// The alternative being read, made when the group gets its first part
+// so that empty groups, and groups still being opened, allocate nothing.
+Generator::Group::Alternative& Generator::Group::current()
+{
+	if (set.empty()) {
+		set.push_back({nullptr, 0, start, std::string::npos, 1, false});
+	}
+	return set.back();
+}
+
+void Generator::Group::add(std::unique_ptr<Generator>&& g)
+{
+	while (!wrappers.empty()) {
+		switch (wrappers.back()) {
+			case reverser:
+				g = make_unique<Reverser>(std::move(g));
+				break;
+			case capitalizer:
+				g = make_unique<Capitalizer>(std::move(g));
+				break;
+		}
+		wrappers.pop_back();
+	}
+	// A lone part needs no Sequence around it
+	Alternative& a = current();
+	if (!a.parts++) {
+		a.sequence = std::move(g);
+		return;
+	} else if (a.parts == 2) {
+		std::unique_ptr<Generator> first = std::move(a.sequence);
+		a.sequence = make_unique<Sequence>();
+		a.sequence->add(std::move(first));
+	}
+	a.sequence->add(std::move(g));
+}
+
+void Generator::Group::add(char c)
+{
+	std::unique_ptr<Generator> g;
+	if (type == group_types::symbol) {
+		g = Table::Symbol(c);
+	}
+	if (!g) {
+		g = Table::Character(c);
+	}
+	add(std::move(g));
+}
+
+std::unique_ptr<Generator> Generator::Group::produce(const std::string& pattern, size_t end)
+{
+	if (set.empty()) {
+		return make_unique<Sequence>();
+	} else if (set.back().end == std::string::npos) {
+		set.back().end = end;
+	}
+
+	// Runs of alternatives with the same text, and so the same names,
+	// become one alternative weighing as much as the run. Wrappers
+	// left over from a previous alternative change the meaning of the
+	// text, so those are kept apart.
+	std::vector<std::unique_ptr<Generator>> choices;
+	std::vector<size_t> weights;
+	for (size_t i = 0; i < set.size(); i++) {
+		const Alternative& a = set[i];
+		if (i && !a.wrapped && !set[i - 1].wrapped &&
+		    a.end - a.start == set[i - 1].end - set[i - 1].start &&
+		    !pattern.compare(a.start, a.end - a.start, pattern, set[i - 1].start, a.end - a.start)) {
+			weights.back() += a.weight;
+			continue;
+		}
+		choices.push_back(a.sequence ? std::move(set[i].sequence) : make_unique<Sequence>());
+		weights.push_back(a.weight);
+	}
+
+	if (choices.size() == 1 && weights[0] == 1) {
+		return std::move(choices[0]);
+	}
+	return make_unique<Random>(std::move(choices), weights);
+}
+
+void Generator::Group::split(size_t at)
+{
+	if (current().end == std::string::npos) {
+		set.back().end = at;
+	}
+	set.push_back({nullptr, 0, at + 1, std::string::npos, 1, !wrappers.empty()});
+}
+
+void Generator::Group::weigh(size_t at, size_t weight)
+{
+	Alternative& a = current();
+	a.end = at;
+	a.weight = weight;
+}
+
+void Generator::Group::wrap(wrappers_t type)
+{
+	wrappers.push_back(type);
+}
+
+Allocator::Allocator() :
+	allocate(nullptr),
+	deallocate(nullptr),
+	state(nullptr)
+{
+}
+
+Allocator::Allocator(void* (*allocate_)(void*, size_t), void (*deallocate_)(void*, void*, size_t), void* state_) :
+	allocate(allocate_),
+	deallocate(deallocate_),
+	state(state_)
+{
+}
+
+struct Program::Build {
+	std::vector<uint32_t> code;
+	std::string pool;
+	std::vector<uint32_t> index;
+	struct Slice {
+		const char* begin;  // first string of the table
+		const char* end;    // just past its last string
+		uint32_t at;        // its first index entry
+	};
+	std::vector<Slice> tables;
+	size_t depth;
+	size_t max_depth;
+	const Generator* root;  // the core() of the tree
+};
+
+Program::Program(const Generator& generator, const Allocator& allocator) :
+	source(allocator),
+	arena(nullptr),
+	words(0),
+	longest(generator.max()),
+	expected(generator.mean()),
+	collapsing(false),
+	build(new Build{{}, {}, {}, {}, 0, 0, generator.core()})
+{
+	generator.compile(*this);
+	emit(halt);
+	pack();
+}
+
+Program::Program(const std::string& pattern, bool collapse_triples, const Allocator& allocator) :
+	Program(Generator(pattern, collapse_triples), allocator)
+{
+}
+
+Program::Program(const Program& other) :
+	source(other.source),
+	arena(nullptr),
+	words(0),
+	packed(other.packed),
+	longest(other.longest),
+	expected(other.expected),
+	collapsing(other.collapsing)
+{
+	arena = reserve(other.words);
+	words = other.words;
+	std::copy(other.arena, other.arena + words, arena);
+	packed.code = arena + (other.packed.code - other.arena);
+	packed.index = arena + (other.packed.index - other.arena);
+	packed.pool = reinterpret_cast<const char*>(arena) +
+	              (other.packed.pool - reinterpret_cast<const char*>(other.arena));
+}
+
+Program::Program(Program&& other) noexcept :
+	source(other.source),
+	arena(other.arena),
+	words(other.words),
+	packed(other.packed),
+	longest(other.longest),
+	expected(other.expected),
+	collapsing(other.collapsing)
+{
+	other.arena = nullptr;
+	other.words = 0;
+}
+
+Program& Program::operator=(Program other)
+{
+	std::swap(source, other.source);
+	std::swap(arena, other.arena);
+	std::swap(words, other.words);
+	std::swap(packed, other.packed);
+	std::swap(longest, other.longest);
+	std::swap(expected, other.expected);
+	std::swap(collapsing, other.collapsing);
+	return *this;
+}
+
+Program::~Program()
+{
+	if (!arena) {
+		return;
+	} else if (source.deallocate) {
+		source.deallocate(source.state, arena, words * sizeof(uint32_t));
+	} else if (!source.allocate) {
+		delete[] arena;
+	}
+}
+
+uint32_t* Program::reserve(size_t n)
+{
+	if (!source.allocate) {
+		return new uint32_t[n];
+	}
+	return static_cast<uint32_t*>(source.allocate(source.state, n * sizeof(uint32_t)));
+}
+
+void Program::pack()
+{
+	// Code first, then the index, then the pool, so that every part
+	// stays aligned
+	const Build& b = *build;
+	size_t bytes = (b.pool.size() + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+	arena = reserve(b.code.size() + b.index.size() + bytes);
+	words = b.code.size() + b.index.size() + bytes;
+	uint32_t* at = std::copy(b.code.begin(), b.code.end(), arena);
+	std::copy(b.index.begin(), b.index.end(), at);
+	char* text = reinterpret_cast<char*>(at + b.index.size());
+	std::copy(b.pool.begin(), b.pool.end(), text);
+	const SymbolTables& symbols = symbolTables();
+	packed = {arena, text, at, b.max_depth, symbols.pool.data(), symbols.index.data()};
+	build.reset();
+}
+
+size_t Program::max() const
+{
+	return longest;
+}
+
+double Program::mean() const
+{
+	return expected;
+}
+
+size_t Program::memory() const
+{
+	return sizeof(*this) + words * sizeof(uint32_t);
+}
+
+bool Program::collapses() const
+{
+	return collapsing;
+}
+
+std::string Program::toString() const
+{
+	return toString(defaultRng());
+}
+
+std::string Program::toString(Rng& rng) const
+{
+	static thread_local std::string scratch;
+	return returned(scratch, [&](std::string& out) { generate(out, rng); });
+}
+
+void Program::generate(std::string& out) const
+{
+	generate(out, defaultRng());
+}
+
+size_t Program::generate(char* dst, size_t len) const noexcept
+{
+	return generate(dst, len, defaultRng());
+}
+
+Batch Program::generateBatch(size_t n, Rng& rng) const
+{
+	if (!collapsing) {
+		return fill(*this, n, rng);
+	}
+	// Collapse the whole arena in one pass rather than name by name
+	Batch batch = fill(packed, n, rng, expected, longest);
+	if (!batch.arena.empty()) {
+		batch.arena.resize(::collapse(&batch.arena[0], batch.arena.size(), &batch.offsets[1]));
+	}
+	return batch;
+}
+
+Batch Program::generateBatch(size_t n) const
+{
+	return generateBatch(n, defaultRng());
+}
+
+void Program::generate(std::string& out, Rng& rng) const
+{
+	size_t from = out.size();
+	packed.generate(out, rng);
+	if (collapsing) {
+		::collapse(out, from);
+	}
+}
+
+size_t Program::generate(char* dst, size_t len, Rng& rng) const noexcept
+{
+	static thread_local std::string scratch;
+	try {
+		copied(scratch, [&](std::string& out) { generate(out, rng); });
+	} catch (...) {
+		scratch.clear();
+	}
+	return copy(scratch, dst, len);
+}
+
+size_t Program::size() const
+{
+	return build->code.size();
+}
+
+void Program::emit(uint32_t word)
+{
+	build->code.push_back(word);
+}
+
+void Program::patch(size_t at, uint32_t word)
+{
+	build->code[at] = word;
+}
+
+void Program::emit(const std::string& value)
+{
+	if (value.empty()) {
+		return;
+	}
+	std::string& pool = build->pool;
+	size_t offset = pool.find(value);
+	if (offset == std::string::npos) {
+		offset = pool.size();
+		pool.append(value);
+	}
+	emit(literal);
+	emit(offset);
+	emit(value.size());
+}
+
+void Program::emit(const std::shared_ptr<const Batch>& strings, size_t first, size_t count, const Alias* alias)
+{
+	// Symbols point into the tables every Program shares
+	if (strings == symbolTables().strings && !alias) {
+		emit(symbol);
+		emit(first);
+		emit(count);
+		return;
+	}
+
+	// The tree outlives compiling, so its strings identify its tables
+	Build& b = *build;
+	const char* begin = (*strings)[first];
+	const char* end = (*strings)[first] + (strings->offsets[first + count] - strings->offsets[first]);
+	size_t t = 0;
+	while (t < b.tables.size() && (b.tables[t].begin != begin || b.tables[t].end != end)) {
+		t++;
+	}
+	if (t == b.tables.size()) {
+		b.tables.push_back({begin, end, uint32_t(b.index.size())});
+		for (size_t i = first; i < first + count; i++) {
+			b.index.push_back(b.pool.size());
+			b.pool.append((*strings)[i], strings->length(i));
+		}
+		b.index.push_back(b.pool.size());
+	}
+	emit(alias ? weighted_table : table);
+	emit(b.tables[t].at);
+	emit(count);
+	if (alias) {
+		alias->compile(*this);
+	}
+}
+
+void Program::open()
+{
+	emit(mark);
+	if (++build->depth > build->max_depth) {
+		build->max_depth = build->depth;
+	}
+}
+
+void Program::close(opcodes_t op)
+{
+	emit(op);
+	build->depth--;
+}
+
+bool Program::defer(const Generator& g)
+{
+	collapsing |= &g == build->root;
+	return &g == build->root;
+}
+
+void StaticProgram::generate(std::string& out, Rng& rng) const
+{
+	// Deeper nesting than fits on the stack uses a buffer kept per
+	// thread, so that it is only allocated the first time
+	size_t local[16];
+	size_t* marks = local;
+	if (depth > sizeof(local) / sizeof(*local)) {
+		static thread_local std::vector<size_t> deep;
+		if (deep.size() < depth) {
+			deep.resize(depth);
+		}
+		marks = deep.data();
+	}
+	size_t sp = 0;
+
+	const uint32_t* ip = code;
+	for (;;) {
+		switch (*ip) {
+			case Program::halt:
+				return;
+			case Program::literal:
+				out.append(pool + ip[1], ip[2]);
+				ip += 3;
+				break;
+			case Program::table: {
+				const uint32_t* i = index + ip[1] + rng.choose(ip[2]);
+				out.append(pool + i[0], i[1] - i[0]);
+				ip += 3;
+				break;
+			}
+			case Program::random:
+				ip = code + ip[2 + rng.choose(ip[1])];
+				break;
+			case Program::weighted_random: {
+				size_t n = ip[1];
+				ip = code + ip[3 + 2 * n + pick(rng, n, ip[2], ip + 3, ip + 3 + n)];
+				break;
+			}
+			case Program::weighted_table: {
+				size_t n = ip[2];
+				const uint32_t* i = index + ip[1] + pick(rng, n, ip[3], ip + 4, ip + 4 + n);
+				out.append(pool + i[0], i[1] - i[0]);
+				ip += 4 + 2 * n;
+				break;
+			}
+			case Program::symbol: {
+				const uint32_t* i = shared_index + ip[1] + rng.choose(ip[2]);
+				out.append(shared_pool + i[0], i[1] - i[0]);
+				ip += 3;
+				break;
+			}
+			case Program::jump:
+				ip = code + ip[1];
+				break;
+			case Program::mark:
+				marks[sp++] = out.size();
+				ip += 1;
+				break;
+			case Program::capitalize:
+				::capitalize(out, marks[--sp]);
+				ip += 1;
+				break;
+			case Program::reverse:
+				::reverse(out, marks[--sp]);
+				ip += 1;
+				break;
+			case Program::collapse:
+				::collapse(out, marks[--sp]);
+				ip += 1;
+				break;
+		}
+	}
+}
+
+size_t StaticProgram::generate(char* dst, size_t len, Rng& rng) const noexcept
+{
+	static thread_local std::string scratch;
+	try {
+		copied(scratch, [&](std::string& out) { generate(out, rng); });
+	} catch (...) {
+		scratch.clear();
+	}
+	return copy(scratch, dst, len);
+}
+
+std::string StaticProgram::toString() const
+{
+	return toString(defaultRng());
+}
+
+std::string StaticProgram::toString(Rng& rng) const
+{
+	static thread_local std::string scratch;
+	return returned(scratch, [&](std::string& out) { generate(out, rng); });
+}
+
+void StaticProgram::generate(std::string& out) const
+{
+	generate(out, defaultRng());
+}
+
+size_t StaticProgram::generate(char* dst, size_t len) const noexcept
+{
+	return generate(dst, len, defaultRng());
+}
+
+std::vector<Batch> NameGen::bulkGenerate(const Program& program, size_t count, uint64_t seed, unsigned threads, Rng::engines_t engine)
+{
+	std::vector<Batch> chunks;
+	streamGenerate(program, count, seed, [&](Batch& chunk) { chunks.push_back(std::move(chunk)); }, threads, engine);
+	return chunks;
+}
+
+std::vector<Batch> NameGen::bulkGenerate(const std::string& pattern, size_t count, uint64_t seed, unsigned threads, Rng::engines_t engine)
+{
+	return bulkGenerate(Program(pattern), count, seed, threads, engine);
+}
+
+void NameGen::streamGenerate(const Program& program, size_t count, uint64_t seed, const std::function<void(Batch& chunk)>& sink,
+                             unsigned threads, Rng::engines_t engine)
+{
+	// Fixed so that chunk boundaries, and so the output, never depend
+	// on the number of threads.
+	const size_t chunk = 1 << 16;
+
+	size_t chunks = count / chunk + (count % chunk ? 1 : 0);
+	if (!threads) {
+		// Which may not be known, in which case it is 0 too
+		threads = std::thread::hardware_concurrency();
+		if (!threads) {
+			threads = 1;
+		}
+	}
+	if (threads > chunks) {
+		threads = chunks;
+	}
+	if (!chunks) {
+		return;
+	}
+
+	// Chunk i waits in slot i % window until the sink has had every
+	// chunk before it; none is started until its slot is free.
+	size_t window = 2 * threads;
+	std::vector<Batch> slots(window);
+	std::vector<char> ready(window);
+	std::mutex lock;
+	std::condition_variable changed;
+	size_t next = 0;
+	size_t done = 0;
+	bool failed = false;
+	std::exception_ptr error;
+
+	auto fail = [&]() {
+		std::lock_guard<std::mutex> hold(lock);
+		if (!failed) {
+			failed = true;
+			error = std::current_exception();
+		}
+	};
+
+	// The workers count against the caller's Counter
+	Counter* counter = Counter::current();
+	auto worker = [&]() {
+		Counter::Use use(counter);
+		for (;;) {
+			size_t i;
+			{
+				std::unique_lock<std::mutex> hold(lock);
+				changed.wait(hold, [&]() { return failed || next >= chunks || next < done + window; });
+				if (failed || next >= chunks) {
+					return;
+				}
+				i = next++;
+			}
+			try {
+				size_t n = i + 1 < chunks ? chunk : count - i * chunk;
+				Rng rng(seed, i, engine);
+				Batch batch = program.generateBatch(n, rng);
+				std::lock_guard<std::mutex> hold(lock);
+				slots[i % window] = std::move(batch);
+				ready[i % window] = true;
+			} catch (...) {
+				fail();
+			}
+			changed.notify_all();
+		}
+	};
+
+	std::vector<std::thread> pool;
+	pool.reserve(threads);
+	try {
+		for (unsigned t = 0; t < threads; t++) {
+			pool.emplace_back(worker);
+		}
+	} catch (...) {
+		// Stop the threads already started before giving up
+		fail();
+		changed.notify_all();
+		for (auto& thread : pool) {
+			thread.join();
+		}
+		throw;
+	}
+	for (size_t i = 0; i < chunks; i++) {
+		Batch batch;
+		{
+			std::unique_lock<std::mutex> hold(lock);
+			changed.wait(hold, [&]() { return failed || ready[i % window]; });
+			if (failed) {
+				break;
+			}
+			batch = std::move(slots[i % window]);
+			ready[i % window] = false;
+			done++;
+		}
+		changed.notify_all();
+		try {
+			sink(batch);
+		} catch (...) {
+			fail();
+			changed.notify_all();
+			break;
+		}
+	}
+	for (auto& thread : pool) {
+		thread.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+
+namespace {
+
+// Generates names straight from pattern text. The pattern is read once,
+// with a stack of the groups still open, into a table of each group's
+// alternatives and how to draw one of them as the optimized tree draws
+// it. A name then only goes through the alternatives drawn, jumping over
+// the groups in the others. The table is kept for the last pattern read
+// on each thread, and scratch space is reused, so a name costs no
+// allocation once it has grown to size.
+class Direct
+{
+	struct Alternative {
+		size_t start, end;
+		size_t weight;
+		bool wrapped;  // wrappers were pending at its start
+		bool folded;   // the same as the one before, and so one with it
+	};
+
+	// A group, its alternatives being alternatives[first] onwards
+	struct Group {
+		char type;       // '<', '(', or 0 for the whole pattern
+		size_t first;
+		size_t choices;  // distinct alternatives, found at choice[first]
+		size_t end;      // just past its closing bracket
+		size_t total;    // of the weights, with its alias table at
+		                 // prob[first] and alias[first] if weighted
+		bool weighted;
+	};
+
+	// A group being read, its alternatives being open[first] onwards
+	struct Frame {
+		size_t group;
+		size_t first;
+	};
+
+	std::string pattern;
+	bool prepared;
+	const char* text;
+	size_t n;
+	std::vector<Group> groups;
+	std::vector<Alternative> alternatives;  // of each group in turn
+	std::vector<size_t> choice;             // the first of each run folded
+	std::vector<uint32_t> prob, alias;      // by alternatives
+	std::vector<size_t> ids;                // of the group opened at each position
+	std::vector<Alternative> open;          // of the groups being read
+	std::vector<Frame> frames;
+	std::string wrappers;                   // '!' or '~' waiting for the next element
+	std::vector<uint32_t> weights, work;
+	const SymbolStrings* symbols[128];
+
+	static bool wrapper(char c)
+	{
+		return c == '!' || c == '~';
+	}
+
+	bool wrappersOnly(const Alternative& a) const
+	{
+		for (size_t i = a.start; i < a.end; i++) {
+			if (!wrapper(text[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Push the wrappers left pending by the alternatives before k, the
+	// first of the group being at `first'.
+	void carry(size_t first, size_t k)
+	{
+		size_t from = k;
+		while (from > first && alternatives[from].wrapped) {
+			if (!wrappersOnly(alternatives[--from])) {
+				break;
+			}
+		}
+		for (size_t j = from; j < k; j++) {
+			const Alternative& a = alternatives[j];
+			size_t i = a.end;
+			while (i > a.start && wrapper(text[i - 1])) {
+				i--;
+			}
+			wrappers.append(text + i, a.end - i);
+		}
+	}
+
+	// Apply the wrappers pending since `base' to the output past `mark',
+	// the last one given innermost.
+	void unwrap(std::string& out, size_t mark, size_t base)
+	{
+		while (wrappers.size() > base) {
+			if (wrappers.back() == '!') {
+				::capitalize(out, mark);
+			} else {
+				::reverse(out, mark);
+			}
+			wrappers.pop_back();
+		}
+	}
+
+	// Start reading a group from text[i], just past its opening bracket
+	// `type'.
+	void enter(char type, size_t i)
+	{
+		frames.push_back({groups.size(), open.size()});
+		groups.push_back({type, 0, 0, n, 0, false});
+		open.push_back({i, n, 1, false, false});
+	}
+
+	// Close the group on top of `frames' at `end'. Its alternatives move
+	// to the table, runs of the same text folding as in Group::produce(),
+	// and it throws as the Alias of a weighted Random does if their
+	// weights, once folded, are too large to sample exactly.
+	void close(size_t end)
+	{
+		Frame& f = frames.back();
+		open.back().end = std::min(open.back().end, end);
+
+		Group& g = groups[f.group];
+		g.first = alternatives.size();
+		g.end = end < n ? end + 1 : n;
+		alternatives.insert(alternatives.end(), open.begin() + f.first, open.end());
+		open.resize(f.first);
+		frames.pop_back();
+
+		weights.clear();
+		choice.resize(alternatives.size());
+		uint64_t total = 0;
+		for (size_t k = g.first; k < alternatives.size(); k++) {
+			Alternative& a = alternatives[k];
+			if (k > g.first) {
+				const Alternative& b = alternatives[k - 1];
+				size_t length = a.end - a.start;
+				a.folded = !a.wrapped && !b.wrapped && length == b.end - b.start &&
+				           !memcmp(text + a.start, text + b.start, length);
+			}
+			if (a.folded) {
+				weights.back() += a.weight;
+				g.weighted = true;
+			} else {
+				choice[g.first + weights.size()] = k;
+				weights.push_back(a.weight);
+				g.weighted |= a.weight != 1;
+			}
+			total += a.weight;
+		}
+		g.choices = weights.size();
+		if (g.weighted && total > UINT32_MAX / g.choices) {
+			throw std::invalid_argument("Weights too large");
+		}
+		g.total = total;
+		if (g.weighted && g.choices > 1) {
+			prob.resize(alternatives.size());
+			alias.resize(alternatives.size());
+			work.resize(g.choices);
+			vose<uint32_t>(weights.data(), g.choices, g.total, &prob[g.first], &alias[g.first], work.data());
+		}
+	}
+
+	// Generate group `id' into `out'.
+	void group(std::string& out, Rng& rng, size_t id)
+	{
+		const Group& g = groups[id];
+		size_t k = g.first;
+		if (g.choices > 1) {
+			size_t chosen = g.weighted ? pick(rng, g.choices, g.total, &prob[g.first], &alias[g.first])
+			                           : rng.choose(g.choices);
+			k = choice[g.first + chosen];
+		}
+
+		size_t base = wrappers.size();
+		if (g.type != '(') {
+			carry(g.first, k);
+		}
+		const Alternative& a = alternatives[k];
+		for (size_t i = a.start; i < a.end; i++) {
+			char c = text[i];
+			unsigned char u = c;
+			size_t mark = out.size();
+			if (c == '<' || c == '(') {
+				group(out, rng, ids[i]);
+				i = groups[ids[i]].end - 1;
+			} else if (g.type == '(') {
+				out.push_back(c);
+			} else if (wrapper(c)) {
+				wrappers.push_back(c);
+				continue;
+			} else if (u < 128 && symbols[u]) {
+				out.append(symbols[u]->strings[rng.choose(symbols[u]->count)]);
+			} else {
+				out.push_back(c);
+			}
+			unwrap(out, mark, base);
+		}
+		wrappers.resize(base);
+	}
+
+public:
+	Direct() :
+		prepared(false),
+		text(nullptr),
+		n(0),
+		symbols()
+	{
+		for (auto& symbol : Symbols::all) {
+			symbols[(unsigned char)symbol.symbol] = &symbol;
+		}
+	}
+
+	static Direct& local()
+	{
+		static thread_local Direct direct;
+		return direct;
+	}
+
+	// Read `pattern_' into the table, unless it was the last one read,
+	// throwing what the Generator constructor throws if it is invalid.
+	void prepare(const std::string& pattern_)
+	{
+		if (prepared && pattern == pattern_) {
+			return;
+		}
+		prepared = false;
+		pattern = pattern_;
+		text = pattern.data();
+		n = pattern.size();
+		groups.clear();
+		alternatives.clear();
+		open.clear();
+		frames.clear();
+		ids.assign(n, 0);
+
+		enter(0, 0);
+		for (size_t i = 0; i < n; i++) {
+			char c = text[i];
+			char type = groups[frames.back().group].type;
+			switch (c) {
+				case '<':
+				case '(':
+					ids[i] = groups.size();
+					enter(c, i + 1);
+					break;
+				case '>':
+				case ')':
+					if (frames.size() == 1) {
+						throw std::invalid_argument("Unbalanced brackets");
+					} else if (c == '>' && type != '<') {
+						throw std::invalid_argument("Unexpected '>' in pattern");
+					} else if (c == ')' && type != '(') {
+						throw std::invalid_argument("Unexpected ')' in pattern");
+					}
+					close(i);
+					break;
+				case '|': {
+					Alternative& a = open.back();
+					a.end = std::min(a.end, i);
+					bool wrapped = type != '(' &&
+					               (a.end > a.start ? wrapper(text[a.end - 1]) : a.wrapped);
+					open.push_back({i + 1, n, 1, wrapped, false});
+					break;
+				}
+				case '^':
+					open.back().end = i;
+					i += weight(pattern, i, open.back().weight) - 1;
+					break;
+			}
+		}
+		if (frames.size() != 1) {
+			throw std::invalid_argument("Missing closing bracket");
+		}
+		close(n);
+		prepared = true;
+	}
+
+	// Generate a name from `pattern_', throwing if it is invalid.
+	void generate(std::string& out, const std::string& pattern_, Rng& rng, bool collapse_triples)
+	{
+		prepare(pattern_);
+		size_t mark = out.size();
+		group(out, rng, 0);
+		if (collapse_triples) {
+			::collapse(out, mark);
+		}
+	}
+};
+
+}
+
+void NameGen::generate(std::string& out, const std::string& pattern, Rng& rng, bool collapse_triples)
+{
+	Direct::local().generate(out, pattern, rng, collapse_triples);
+}
+
+std::string NameGen::generate(const std::string& pattern, Rng& rng, bool collapse_triples)
+{
+	static thread_local std::string scratch;
+	return returned(scratch, [&](std::string& out) { generate(out, pattern, rng, collapse_triples); });
+}
+
+std::string NameGen::generate(const std::string& pattern, bool collapse_triples)
+{
+	return generate(pattern, defaultRng(), collapse_triples);
+}
+
+
+namespace {
+
+// A pattern generated from directly, for fill()
+struct Straight {
+	const std::string& pattern;
+	bool collapse_triples;
+
+	void generate(std::string& out, Rng& rng) const
+	{
+		Direct::local().generate(out, pattern, rng, collapse_triples);
+	}
+};
+
+}
+
+
+// Compiling costs about as much as reading the pattern 25 to 30 times
+// for direct generation, which a thread does again whenever it switches
+// to another pattern.
+const size_t Adaptive::threshold = 32;
+
+Adaptive::Adaptive(const std::string& pattern_, bool collapse_triples_, size_t expected) :
+	pattern(pattern_),
+	collapse_triples(collapse_triples_),
+	uses(0),
+	ready(false)
+{
+	Direct::local().prepare(pattern);
+	compiled(expected);
+}
+
+// The Program, if `n' more uses make it worth compiling.
+const Program* Adaptive::compiled(size_t n)
+{
+	if (ready) {
+		return program.get();
+	}
+	if (uses.fetch_add(n) + n < threshold) {
+		return nullptr;
+	}
+	std::call_once(once, [this]() {
+		program.reset(new Program(pattern, collapse_triples));
+		ready = true;
+	});
+	return program.get();
+}
+
+bool Adaptive::isCompiled() const
+{
+	return ready;
+}
+
+std::string Adaptive::toString()
+{
+	return toString(defaultRng());
+}
+
+std::string Adaptive::toString(Rng& rng)
+{
+	static thread_local std::string scratch;
+	return returned(scratch, [&](std::string& out) { generate(out, rng); });
+}
+
+void Adaptive::generate(std::string& out)
+{
+	generate(out, defaultRng());
+}
+
+void Adaptive::generate(std::string& out, Rng& rng)
+{
+	if (const Program* p = compiled(1)) {
+		p->generate(out, rng);
+	} else {
+		Direct::local().generate(out, pattern, rng, collapse_triples);
+	}
+}
+
+Batch Adaptive::generateBatch(size_t n, Rng& rng)
+{
+	if (const Program* p = compiled(n)) {
+		return p->generateBatch(n, rng);
+	}
+	return fill(Straight{pattern, collapse_triples}, n, rng, 0, 0);
+}
+
+Batch Adaptive::generateBatch(size_t n)
+{
+	return generateBatch(n, defaultRng());
+}
+
+
+Cache::Cache(size_t budget_) :
+	budget(budget_),
+	memory(0),
+	hits(0),
+	misses(0),
+	evictions(0)
+{
+}
+
+Cache& Cache::global()
+{
+	static Cache cache;
+	return cache;
+}
+
+std::shared_ptr<const Generator> Cache::get(const std::string& pattern, bool collapse_triples)
+{
+	std::string key = pattern;
+	key.push_back(collapse_triples ? '\1' : '\0');
+	Shard& shard = shards[std::hash<std::string>()(key) % shards_count];
+
+	std::promise<std::shared_ptr<const Generator>> promise;
+	future_t cached;
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto found = shard.index.find(key);
+		if (found != shard.index.end()) {
+			shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+			cached = found->second->generator;
+		} else {
+			shard.entries.push_front(Entry{key, promise.get_future().share(), 0});
+			shard.index[key] = shard.entries.begin();
+		}
+	}
+	if (cached.valid()) {
+		hits++;
+		return cached.get();
+	}
+	misses++;
+
+	// Compile outside the lock; others asking meanwhile wait on the
+	// future rather than compiling again.
+	std::shared_ptr<const Generator> generator;
+	try {
+		generator = std::make_shared<const Generator>(pattern, collapse_triples);
+	} catch (...) {
+		promise.set_exception(std::current_exception());
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto found = shard.index.find(key);
+		if (found != shard.index.end()) {
+			shard.entries.erase(found->second);
+			shard.index.erase(found);
+		}
+		throw;
+	}
+	promise.set_value(generator);
+
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto found = shard.index.find(key);
+		if (found != shard.index.end()) {
+			Entry& entry = *found->second;
+			entry.memory = generator->memory();
+			if (entry.memory > budget) {
+				// Keeping it would take every other entry and still
+				// be over budget
+				shard.entries.erase(found->second);
+				shard.index.erase(found);
+				evictions++;
+				return generator;
+			}
+			shard.memory += entry.memory;
+			memory += entry.memory;
+			evict(shard, &key);
+		}
+	}
+	// The budget is for the whole cache, so other shards give way when
+	// this one cannot, one lock at a time
+	for (size_t i = 0; i < shards_count && memory > budget; i++) {
+		if (&shards[i] != &shard) {
+			std::lock_guard<std::mutex> guard(shards[i].lock);
+			evict(shards[i], nullptr);
+		}
+	}
+	return generator;
+}
+
+void Cache::evict(Shard& shard, const std::string* keep)
+{
+	auto last = shard.entries.end();
+	while (memory > budget && last != shard.entries.begin()) {
+		--last;
+		if (keep && last->key == *keep) {
+			continue;
+		}
+		shard.memory -= last->memory;
+		memory -= last->memory;
+		shard.index.erase(last->key);
+		last = shard.entries.erase(last);
+		evictions++;
+	}
+}
+
+Cache::Stats Cache::stats()
+{
+	Stats stats = {hits, misses, evictions, 0, 0};
+	for (auto& shard : shards) {
+		std::lock_guard<std::mutex> guard(shard.lock);
+		stats.entries += shard.entries.size();
+		stats.memory += shard.memory;
+	}
+	return stats;
+}
+
+void Cache::clear()
+{
+	for (auto& shard : shards) {
+		std::lock_guard<std::mutex> guard(shard.lock);
+		shard.entries.clear();
+		shard.index.clear();
+		memory -= shard.memory;
+		shard.memory = 0;
+	}
 }
 
 std::wstring towstring(const std::string & s)
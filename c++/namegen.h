@@ -44,6 +44,13 @@
  * either "foo" or "bar". The pattern "<c|v|>" produces a constant,
  * vowel, or nothing at all.
  *
+ *   An alternative ending in a caret and a number ^N weighs as much as
+ * N copies of it. For example, "(foo^3|bar)" produces "foo" three times
+ * as often as "bar", the same as "(foo|foo|foo|bar)" does. A caret
+ * always starts a weight, even between parentheses, so a pattern with a
+ * caret not followed by a number and then the end of its alternative is
+ * invalid.
+ *
  *   An exclamation point ! means to capitalize the component that
  * follows it. For example, "!(foo)" will produce "Foo" and "v!s" will
  * produce a lowercase vowel followed by a capitalized syllable, like
@@ -63,20 +70,33 @@
  * with the `new` keyword: they may pass through a provided generator,
  * combine provided generators, or even return a simple string.
  *
- *   New pattern symbols added to Generator.symbols will automatically
- * be used by the compiler.
+ *   New pattern symbols added to Symbols::all will automatically be
+ * used by the compiler.
  */
 
 #pragma once
 
 #include <stddef.h>       // for size_t
+#include <stdint.h>       // for uint32_t
+#include <atomic>         // for atomic
+#include <functional>     // for function
+#include <future>         // for shared_future
 #include <iosfwd>         // for wstring
-#include <memory>         // for unique_ptr
-#include <stack>          // for stack
+#include <iterator>       // for input_iterator_tag
+#include <list>           // for list
+#include <map>            // for map
+#include <memory>         // for unique_ptr, shared_ptr
+#include <mutex>          // for mutex
+#include <random>         // for mt19937
+#include <stdexcept>      // for invalid_argument
 #include <string>         // for string
 #include <unordered_map>  // for unordered_map
 #include <vector>         // for vector
 
+#if __cplusplus >= 201703L
+#include <memory_resource>  // for memory_resource, pmr::string
+#endif
+
 
 namespace NameGen {
 
@@ -137,6 +157,378 @@ namespace NameGen {
 // Fantasy (S, E, etc.)
 #define FANTASY_S_E "(syth|sith|srr|sen|yth|ssen|then|fen|ssth|kel|syn|est|bess|inth|nen|tin|cor|sv|iss|ith|sen|slar|ssil|sthen|svis|s|ss|s|ss)(|(tys|eus|yn|of|es|en|ath|elth|al|ell|ka|ith|yrrl|is|isl|yr|ast|iy))(us|yn|en|ens|ra|rg|le|en|ith|ast|zon|in|yn|ys)"
 
+/**
+ * The strings each pattern symbol stands for. A symbol picks uniformly
+ * from its strings, in this order. SymbolMap() is built from these, and
+ * they are constexpr so that patterns can be compiled while building.
+ */
+struct SymbolStrings {
+	char symbol;
+	const char* const* strings;
+	size_t count;
+};
+
+namespace Symbols {
+
+constexpr const char* const s[] = {
+	"ach", "ack", "ad", "age", "ald", "ale", "an", "ang", "ar", "ard",
+	"as", "ash", "at", "ath", "augh", "aw", "ban", "bel", "bur", "cer",
+	"cha", "che", "dan", "dar", "del", "den", "dra", "dyn", "ech", "eld",
+	"elm", "em", "en", "end", "eng", "enth", "er", "ess", "est", "et",
+	"gar", "gha", "hat", "hin", "hon", "ia", "ight", "ild", "im", "ina",
+	"ine", "ing", "ir", "is", "iss", "it", "kal", "kel", "kim", "kin",
+	"ler", "lor", "lye", "mor", "mos", "nal", "ny", "nys", "old", "om",
+	"on", "or", "orm", "os", "ough", "per", "pol", "qua", "que", "rad",
+	"rak", "ran", "ray", "ril", "ris", "rod", "roth", "ryn", "sam",
+	"say", "ser", "shy", "skel", "sul", "tai", "tan", "tas", "ther",
+	"tia", "tin", "ton", "tor", "tur", "um", "und", "unt", "urn", "usk",
+	"ust", "ver", "ves", "vor", "war", "wor", "yer"
+};
+
+constexpr const char* const v[] = {
+	"a", "e", "i", "o", "u", "y"
+};
+
+constexpr const char* const V[] = {
+	"a", "e", "i", "o", "u", "y", "ae", "ai", "au", "ay", "ea", "ee",
+	"ei", "eu", "ey", "ia", "ie", "oe", "oi", "oo", "ou", "ui"
+};
+
+constexpr const char* const c[] = {
+	"b", "c", "d", "f", "g", "h", "j", "k", "l", "m", "n", "p", "q", "r",
+	"s", "t", "v", "w", "x", "y", "z"
+};
+
+constexpr const char* const B[] = {
+	"b", "bl", "br", "c", "ch", "chr", "cl", "cr", "d", "dr", "f", "g",
+	"h", "j", "k", "l", "ll", "m", "n", "p", "ph", "qu", "r", "rh", "s",
+	"sch", "sh", "sl", "sm", "sn", "st", "str", "sw", "t", "th", "thr",
+	"tr", "v", "w", "wh", "y", "z", "zh"
+};
+
+constexpr const char* const C[] = {
+	"b", "c", "ch", "ck", "d", "f", "g", "gh", "h", "k", "l", "ld", "ll",
+	"lt", "m", "n", "nd", "nn", "nt", "p", "ph", "q", "r", "rd", "rr",
+	"rt", "s", "sh", "ss", "st", "t", "th", "v", "w", "y", "z"
+};
+
+constexpr const char* const i[] = {
+	"air", "ankle", "ball", "beef", "bone", "bum", "bumble", "bump",
+	"cheese", "clod", "clot", "clown", "corn", "dip", "dolt", "doof",
+	"dork", "dumb", "face", "finger", "foot", "fumble", "goof",
+	"grumble", "head", "knock", "knocker", "knuckle", "loaf", "lump",
+	"lunk", "meat", "muck", "munch", "nit", "numb", "pin", "puff",
+	"skull", "snark", "sneeze", "thimble", "twerp", "twit", "wad",
+	"wimp", "wipe"
+};
+
+constexpr const char* const m[] = {
+	"baby", "booble", "bunker", "cuddle", "cuddly", "cutie", "doodle",
+	"foofie", "gooble", "honey", "kissie", "lover", "lovey", "moofie",
+	"mooglie", "moopie", "moopsie", "nookum", "poochie", "poof",
+	"poofie", "pookie", "schmoopie", "schnoogle", "schnookie",
+	"schnookum", "smooch", "smoochie", "smoosh", "snoogle", "snoogy",
+	"snookie", "snookum", "snuggy", "sweetie", "woogle", "woogy",
+	"wookie", "wookum", "wuddle", "wuddly", "wuggy", "wunny"
+};
+
+constexpr const char* const M[] = {
+	"boo", "bunch", "bunny", "cake", "cakes", "cute", "darling",
+	"dumpling", "dumplings", "face", "foof", "goo", "head", "kin",
+	"kins", "lips", "love", "mush", "pie", "poo", "pooh", "pook", "pums"
+};
+
+constexpr const char* const D[] = {
+	"b", "bl", "br", "cl", "d", "f", "fl", "fr", "g", "gh", "gl", "gr",
+	"h", "j", "k", "kl", "m", "n", "p", "th", "w"
+};
+
+constexpr const char* const d[] = {
+	"elch", "idiot", "ob", "og", "ok", "olph", "olt", "omph", "ong",
+	"onk", "oo", "oob", "oof", "oog", "ook", "ooz", "org", "ork", "orm",
+	"oron", "ub", "uck", "ug", "ulf", "ult", "um", "umb", "ump", "umph",
+	"un", "unb", "ung", "unk", "unph", "unt", "uzz"
+};
+
+constexpr SymbolStrings all[] = {
+	{'s', s, sizeof(s) / sizeof(*s)},
+	{'v', v, sizeof(v) / sizeof(*v)},
+	{'V', V, sizeof(V) / sizeof(*V)},
+	{'c', c, sizeof(c) / sizeof(*c)},
+	{'B', B, sizeof(B) / sizeof(*B)},
+	{'C', C, sizeof(C) / sizeof(*C)},
+	{'i', i, sizeof(i) / sizeof(*i)},
+	{'m', m, sizeof(m) / sizeof(*m)},
+	{'M', M, sizeof(M) / sizeof(*M)},
+	{'D', D, sizeof(D) / sizeof(*D)},
+	{'d', d, sizeof(d) / sizeof(*d)},
+};
+
+}
+
+
+
+class Program;
+class Enumeration;
+
+
+/**
+ * Many names stored back to back in one arena, each terminated by a
+ * NUL byte, and indexed by a table of offsets. Like namegen_argz in
+ * the C version this is a packed string table rather than a pile of
+ * separate strings, so it is cheap to produce, ship, and free.
+ */
+class Batch
+{
+public:
+	std::string arena;
+	std::vector<size_t> offsets;  // start of each name, plus the end
+
+	Batch();
+
+	size_t size() const;
+	size_t length(size_t i) const;
+	const char* operator[](size_t i) const;
+};
+
+
+/**
+ * Counts the names generated, and the heap allocations made to hold
+ * them, while it exists. Every engine counts against the Counter made
+ * last on the thread that generates, and against those made before it
+ * there; the threads of streamGenerate() and bulkGenerate() count
+ * against their caller's. Allocations are seen from where a buffer's
+ * data moves when it grows, so they are the ones the standard library
+ * really made: none while a name fits within its string or in a buffer
+ * kept from the last name, and one of the buffer's capacity otherwise.
+ * A buffer that grows twice for one name counts once. Names appended
+ * to a string of the caller's are not counted, as that string and its
+ * growth are the caller's, and neither is working memory that a call
+ * frees before it returns, such as the length tables of a toString()
+ * within lengths. With no Counter, counting costs one check per name.
+ * Counters must go in the reverse order they came in, as they do on
+ * the stack.
+ *
+ *   NameGen::Counter counter;
+ *   generator.generateBatch(1000);
+ *   counter.counts().allocations;  // => 3
+ */
+class Counter
+{
+public:
+	struct Counts {
+		size_t names;
+		size_t allocations;
+		size_t bytes;
+	};
+
+	// Makes this thread count against `counter', and those it was made
+	// within, while it exists.
+	class Use
+	{
+		Counter* outer;
+
+	public:
+		explicit Use(Counter* counter);
+		~Use();
+		Use(const Use&) = delete;
+		Use& operator=(const Use&) = delete;
+	};
+
+	Counter();
+	~Counter();
+	Counter(const Counter&) = delete;
+	Counter& operator=(const Counter&) = delete;
+
+	Counts counts() const;
+
+	// The Counter names on this thread count against, if any.
+	static Counter* current();
+
+	// Count `names' and `allocations' of `bytes' in all against
+	// current() and the Counters it was made within.
+	static void count(size_t names, size_t allocations, size_t bytes);
+
+	// Whether `buffer' holds its data in a heap block rather than
+	// within itself, and the size of that block.
+	template <typename S>
+	static bool allocated(const S& buffer)
+	{
+		const char* data = reinterpret_cast<const char*>(buffer.data());
+		const char* self = reinterpret_cast<const char*>(&buffer);
+		return data && (std::less<const char*>()(data, self) || !std::less<const char*>()(data, self + sizeof(buffer)));
+	}
+
+	template <typename C, typename T, typename A>
+	static size_t block(const std::basic_string<C, T, A>& buffer)
+	{
+		return (buffer.capacity() + 1) * sizeof(C);
+	}
+
+	template <typename T, typename A>
+	static size_t block(const std::vector<T, A>& buffer)
+	{
+		return buffer.capacity() * sizeof(T);
+	}
+
+	// Count the allocation `buffer' made if its data has moved from
+	// `data', which is then moved along with it.
+	template <typename S>
+	static void grown(const S& buffer, const void*& data)
+	{
+		if (buffer.data() != data) {
+			data = buffer.data();
+			if (current() && allocated(buffer)) {
+				count(0, 1, block(buffer));
+			}
+		}
+	}
+
+	// Count a name returned in `name', with the allocation holding it.
+	template <typename S>
+	static void returned(const S& name)
+	{
+		if (current()) {
+			bool heap = allocated(name);
+			count(1, heap, heap ? block(name) : 0);
+		}
+	}
+
+private:
+	Counter* outer;
+	std::atomic<size_t> names;
+	std::atomic<size_t> allocations;
+	std::atomic<size_t> bytes;
+};
+
+
+/**
+ * Random state used while generating. A compiled Generator or Program
+ * is never modified by generation, so any number of threads can share
+ * one as long as each brings its own Rng.
+ *
+ * The engine is picked when the Rng is made: xoshiro256** by default,
+ * PCG32, wyrand, or std::mt19937 for compatibility with code seeding
+ * one. Choices are drawn from the engine in integers only, so a seed
+ * gives the same names with every compiler and on every platform.
+ * Only a std::mt19937 is kept on the heap, so the other engines need
+ * no allocation and an Rng stays a few words long.
+ */
+class Rng
+{
+public:
+	typedef enum engines {
+		xoshiro256,
+		pcg32,
+		wyrand,
+		mt19937
+	} engines_t;
+
+	Rng(engines_t engine_=xoshiro256);
+	Rng(uint32_t seed_, engines_t engine_=xoshiro256);
+	Rng(uint64_t seed_, uint64_t stream, engines_t engine_=xoshiro256);
+
+	Rng(const Rng& other);
+	Rng(Rng&& other) = default;
+	Rng& operator=(const Rng& other);
+	Rng& operator=(Rng&& other) = default;
+
+	void seed(uint32_t seed_);
+	void seed(uint64_t seed_, uint64_t stream);
+	uint32_t next();
+	size_t choose(size_t n);
+
+private:
+	engines_t engine;
+	uint64_t state[4];         // xoshiro256**; PCG32 and wyrand use less
+	std::unique_ptr<std::mt19937> twister;  // its 5 KB, for mt19937 only
+};
+
+
+#if __cplusplus >= 201402L
+#define NAMEGEN_CONSTEXPR constexpr
+#else
+#define NAMEGEN_CONSTEXPR inline
+#endif
+
+/**
+ * Walker's alias table for n weights summing to `total', set up as Vose
+ * does but in integers, so that it is exact and the same everywhere:
+ * pick a column i uniformly, then keep i if a choice below `total' falls
+ * under prob[i], and take alias[i] otherwise. `work' holds n entries.
+ * Every value stays within total * n.
+ */
+template <typename T>
+NAMEGEN_CONSTEXPR void vose(const T* weights, size_t n, T total, T* prob, T* alias, T* work)
+{
+	// Small columns stack up from the front of `work', large ones from
+	// the back
+	size_t small = 0;
+	size_t large = n;
+	for (size_t i = 0; i < n; i++) {
+		prob[i] = weights[i] * n;
+		if (prob[i] < total) {
+			work[small++] = i;
+		} else {
+			work[--large] = i;
+		}
+	}
+	while (small && large < n) {
+		T s = work[--small];
+		T l = work[large++];
+		alias[s] = l;
+		prob[l] = prob[l] + prob[s] - total;
+		if (prob[l] < total) {
+			work[small++] = l;
+		} else {
+			work[--large] = l;
+		}
+	}
+	while (small) {
+		T i = work[--small];
+		prob[i] = total;
+		alias[i] = i;
+	}
+	while (large < n) {
+		T i = work[large++];
+		prob[i] = total;
+		alias[i] = i;
+	}
+}
+
+
+/**
+ * Weights of the alternatives of a choice, sampled in constant time
+ * through an alias table. An alternative of weight w stands for w
+ * copies of it in a row, which is how names are numbered and counted.
+ */
+class Alias
+{
+	std::vector<uint32_t> prob;
+	std::vector<uint32_t> alias;
+	std::vector<size_t> starts;  // index of the first copy of each, plus the end
+
+public:
+	// Throws std::invalid_argument for a zero weight, or weights too
+	// large to sample exactly.
+	Alias(const std::vector<size_t>& weights);
+
+	size_t size() const;
+	size_t total() const;
+	size_t weight(size_t i) const;
+	size_t start(size_t i) const;
+
+	// Alternative with a copy numbered `index'.
+	size_t find(size_t index) const;
+
+	// Alternative chosen at random; draws nothing when there is only one.
+	size_t choose(Rng& rng) const;
+
+	size_t memory() const;
+	size_t allocations() const;  // heap blocks held
+	void compile(Program& program) const;
+};
+
 
 class Generator
 {
@@ -152,67 +544,347 @@ class Generator
 
 
 	class Group {
-		std::stack<wrappers_t> wrappers;
-		std::vector<std::unique_ptr<Generator>> set;
+		struct Alternative {
+			std::unique_ptr<Generator> sequence;  // or its only part
+			size_t parts;
+			size_t start;  // where its text lies in the pattern
+			size_t end;
+			size_t weight;
+			bool wrapped;  // wrappers were waiting when it started
+		};
+
+		std::vector<wrappers_t> wrappers;
+		std::vector<Alternative> set;  // empty until something is added
+		size_t start;
+
+		Alternative& current();
 
 	public:
 		group_types_t type;
 
-		Group(group_types_t type_);
-		virtual ~Group() { }
+		Group(group_types_t type_, size_t start);
 
-                std::unique_ptr<Generator> produce();
-		void split();
+		std::unique_ptr<Generator> produce(const std::string& pattern, size_t end);
+		void split(size_t at);
+		void weigh(size_t at, size_t weight);
 		void wrap(wrappers_t type);
 		void add(std::unique_ptr<Generator>&& g);
-
-		virtual void add(char c);
-	};
-
-
-	class GroupSymbol : public Group {
-	public:
-		GroupSymbol();
 		void add(char c);
 	};
 
-
-	class GroupLiteral : public Group {
-	public:
-		GroupLiteral();
-	};
-
 protected:
 	std::vector<std::unique_ptr<Generator>> generators;
 
+	// Metadata accumulated as children are added, so queries are O(1)
+	size_t combos = 1;
+	size_t shortest = 0;
+	size_t longest = 0;
+	double expected = 0;  // mean length of a name
+	bool overflow = false;
+	bool ascii = true;
+	bool shrinking = false;  // a wrapper below may shorten names
+	bool resizing = false;   // a wrapper below may change their length
+
+	virtual void include(const Generator& g);
+
+	// `g' optimized, or `g' itself if it has nothing to improve.
+	static std::unique_ptr<Generator> optimized(std::unique_ptr<Generator>&& g);
+
 public:
 	static const std::unordered_map<std::string, const std::vector<std::string>>& SymbolMap();
 
 	Generator();
-	Generator(const std::string& pattern, bool collapse_triples=true);
+	Generator(const std::string& pattern, bool collapse_triples=true, bool optimize_tree=true);
 	Generator(std::vector<std::unique_ptr<Generator>>&& generators_);
 
 	virtual ~Generator() = default;
 
-	virtual size_t combinations();
-	virtual size_t min();
-	virtual size_t max();
-	virtual std::string toString();
+	// Number of ways the generator can produce a name, saturating at
+	// SIZE_MAX, in which case overflows() is true.
+	size_t combinations() const;
+	bool overflows() const;
+	size_t min() const;
+	size_t max() const;
+
+	// Mean length of the names toString() draws, before any wrapper
+	// changes it.
+	double mean() const;
+
+	// Whether every byte of every name is ASCII.
+	bool isAscii() const;
+
+	// Whether a wrapper may make names shorter than their parts, as
+	// collapsing does, or change their length either way, as
+	// capitalizing other than ASCII can. min() and max() are of the
+	// lengths before that.
+	bool shrinks() const;
+	bool resizes() const;
+
+	// Approximate bytes of memory held by this node and its children.
+	virtual size_t memory() const;
+
+	// Number of nodes in the tree.
+	size_t nodes() const;
+
+	// The node that makes this node's names: this one, or, while a node
+	// only joins the names of its one child, that child.
+	const Generator* core() const;
+
+	// What a tree is made of, to see where its memory goes.
+	struct Profile {
+		size_t nodes;
+		size_t depth;        // nodes on the longest path down from the root
+		size_t memory;       // bytes held, as memory() counts them
+		size_t allocations;  // heap blocks held below the root
+		std::map<std::string, size_t> types;  // nodes of each type()
+	};
+
+	Profile profile() const;
+
+	// Name of the node's class, as profile() counts it.
+	virtual const char* type() const;
+
+protected:
+	// Add this node and its children, `depth' levels down, to `p'.
+	virtual void account(Profile& p, size_t depth) const;
+
+public:
+
+	// An equivalent of this node that is cheaper to run: the same names,
+	// numbered the same way and drawn with the same probabilities. It
+	// may take this node's children, after which only the result is
+	// usable. Returns nullptr when there is nothing to improve.
+	virtual std::unique_ptr<Generator> optimize();
+
+	// For a leaf, the leaf with `f' applied to each of its names, so
+	// that wrappers can be folded into it; otherwise nullptr.
+	virtual std::unique_ptr<Generator> transform(void (*f)(std::string& s, size_t from)) const;
+
+	virtual void compile(Program& program) const;
+
+	// Append a name to `out', reusing its capacity.
+	virtual void generate(std::string& out, Rng& rng) const;
+
+	// Names are numbered from 0 to combinations() - 1 in odometer order:
+	// mixed radix over a sequence, with its last component the least
+	// significant digit, and consecutive ranges for the alternatives of
+	// a random choice. Different indices may give the same name, for
+	// example through the Collapser or repeated alternatives.
+	static const size_t npos = -1;
 
+	// Name numbered `index'. Throws std::out_of_range for an index past
+	// the end, and std::invalid_argument when combinations() overflows.
+	std::string nameAt(size_t index) const;
+
+	// Smallest index whose name is `name', or npos if there is none.
+	// It takes time in proportion to the names of a node only below a
+	// Reverser of names that are not all ASCII, or below a Capitalizer
+	// inside a Reverser, where every name of the node is tried.
+	size_t indexOf(const std::string& name) const;
+
+	// Every name in index order, starting from the position token
+	// `from', generated lazily. Throws std::invalid_argument when
+	// combinations() overflows.
+	Enumeration names(size_t from=0) const;
+
+	// Append the name numbered `index' to `out'.
+	virtual void nameAt(std::string& out, size_t index) const;
+
+	// A partial match of a name for indexOf(): how far into the name it
+	// got, the state of enclosing wrappers, and the smallest index of
+	// this node's names that gets there.
+	struct Match {
+		size_t pos;
+		size_t index;
+		uint32_t pch;     // last character seen by the Collapser
+		int cnt;          // times the Collapser has seen it repeated, up to 2
+		bool collapsing;  // inside a Collapser
+		int capitalize;   // Capitalizers waiting for the next character
+		bool reversed;    // inside a Reverser, so matched last part first
+		uint32_t partial; // bytes of a character split across nodes
+		int have;         // number of bytes in `partial'
+		int need;         // length of the character being completed
+	};
+
+	// Add to `out' every way this node can continue matching `name'
+	// from `in'.
+	virtual void match(const std::string& name, const Match& in, std::vector<Match>& out) const;
+	void matchEach(const std::string& name, const Match& in, std::vector<Match>& out) const;
+
+	// Write a NUL-terminated name into `dst' of `len' bytes. Returns the
+	// length of the full name, so like the C namegen() truncation is
+	// reported: a result of `len' or more means the name did not fit.
+	size_t generate(char* dst, size_t len, Rng& rng) const noexcept;
+
+	// Without an explicit Rng, a per-thread default is used.
+	std::string toString() const;
+	std::string toString(Rng& rng) const;
+	void generate(std::string& out) const;
+	size_t generate(char* dst, size_t len) const noexcept;
+
+	// Generate `n' names into a single Batch.
+	Batch generateBatch(size_t n, Rng& rng) const;
+	Batch generateBatch(size_t n) const;
+
+	// Append a name of `minLen' to `maxLen' bytes, drawn in a single pass
+	// with the chance it has among such names of toString(), as if names
+	// were drawn until one fit. Throws std::invalid_argument if none fits.
+	// Each call works out the chances of names fitting, as Bounded
+	// describes; Bounded keeps them for drawing many names.
+	void generate(std::string& out, size_t minLen, size_t maxLen, Rng& rng) const;
+	std::string toString(size_t minLen, size_t maxLen, Rng& rng) const;
+	std::string toString(size_t minLen, size_t maxLen) const;
+
+	// Chances of names fitting within lengths, for Bounded. Wrappers
+	// change what their children output, so the state they are in (a
+	// Match with no name to match) is followed from node to node.
+	struct Lengths;
+
+	// The chance that generate() draws the name numbered `index'.
+	virtual double chance(size_t index) const;
+
+	// Add to `l' what this node can do when started in state `in': the
+	// states it may leave, and what it chooses between.
+	virtual void reach(Lengths& l, size_t in) const;
+
+	// Work out, for every state this node may start in, the chances of
+	// a name fitting by the bytes output so far, given those `after' it
+	// in each state it may leave, indexed by state number.
+	virtual void fit(Lengths& l, const std::vector<const double*>& after) const;
+
+	// Append output to a name being drawn within lengths, choosing only
+	// what can still fit, from `state' with `bytes' output so far; both
+	// are moved on past it.
+	virtual void generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const;
+
+protected:
+	// The same for a node whose names are tried whole, from `in'.
+	void reachWhole(Lengths& l, size_t in) const;
+	void generateWhole(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const;
+
+public:
+	// Generate `n' distinct names into a single Batch. While duplicates
+	// are rare names are drawn as usual and deduplicated, so that each
+	// new name comes with the chance toString() gives it. When `n' is
+	// more than half of combinations(), or duplicates start to dominate,
+	// the rest are instead drawn by index without replacement, every
+	// index as likely as any other, whatever the weights of the choices
+	// leading to it. Which names come out then depends on `n': with 59
+	// names of "(a|<s>)" drawn, "a" is as likely as any syllable to be
+	// among them, rather than almost sure to be. Throws
+	// std::invalid_argument if `n' exceeds combinations(), or if that
+	// many distinct names are not found within 64 draws per name, as
+	// when the pattern cannot produce them.
+	Batch generateUnique(size_t n, Rng& rng) const;
+	Batch generateUnique(size_t n) const;
+
+	// Children must be complete when added: their metadata is folded
+	// into this node's at that point.
 	void add(std::unique_ptr<Generator>&& g);
 };
 
 
+/**
+ * A lazy range over the names of a Generator in index order. Only the
+ * current position and name are kept, and an iterator's position() is a
+ * token from which Generator::names() can resume.
+ */
+class Enumeration
+{
+	const Generator* generator;
+	size_t first;
+
+public:
+	class iterator
+	{
+		const Generator* generator;
+		size_t index;
+		std::string name;
+
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef std::string value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const std::string* pointer;
+		typedef const std::string& reference;
+
+		iterator(const Generator* generator_, size_t index_);
+
+		const std::string& operator*() const;
+		const std::string* operator->() const;
+		iterator& operator++();
+		bool operator==(const iterator& other) const;
+		bool operator!=(const iterator& other) const;
+
+		size_t position() const;
+	};
+
+	Enumeration(const Generator* generator_, size_t first_);
+
+	iterator begin() const;
+	iterator end() const;
+};
+
+
+/**
+ * Names of a Generator of `minLen' to `maxLen' bytes, as generated by
+ * Generator::generate(out, minLen, maxLen, rng) but with the chances of
+ * fitting worked out once, when it is made. Each choice is made only
+ * among what can still fit, with the chance that it leads to a name that
+ * does, so every name is drawn in a single pass with the chance it has
+ * among names of those lengths. The Generator must outlive it.
+ *
+ * Collapsing, capitalizing and reversing are followed through the tree
+ * a character at a time, as indexOf() follows them, so lengths are those
+ * of names as they come out. Working them out takes time in proportion
+ * to the names of a node only below a Reverser of names that are not all
+ * ASCII, or below a Capitalizer inside a Reverser, where every name of
+ * the node is tried; such a node with too many names to count throws
+ * std::invalid_argument.
+ */
+class Bounded
+{
+	const Generator& generator;
+	std::shared_ptr<const Generator::Lengths> lengths;
+
+public:
+	// Throws std::invalid_argument when no name can be in range.
+	Bounded(const Generator& generator_, size_t minLen, size_t maxLen);
+
+	void generate(std::string& out, Rng& rng) const;
+	std::string toString(Rng& rng) const;
+	void generate(std::string& out) const;
+	std::string toString() const;
+};
+
+
 class Random : public Generator
 {
+	std::vector<size_t> weights;
+	std::shared_ptr<const Alias> alias;  // unless every weight is 1
+
+protected:
+	void include(const Generator& g);
+
 public:
 	Random();
 	Random(std::vector<std::unique_ptr<Generator>>&& generators_);
+	Random(std::vector<std::unique_ptr<Generator>>&& generators_, const std::vector<size_t>& weights_);
 
-	size_t combinations();
-	size_t min();
-	size_t max();
-	std::string toString();
+	using Generator::generate;
+	using Generator::nameAt;
+	void generate(std::string& out, Rng& rng) const;
+	double chance(size_t index) const;
+	void reach(Lengths& l, size_t in) const;
+	void fit(Lengths& l, const std::vector<const double*>& after) const;
+	void generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const;
+	void nameAt(std::string& out, size_t index) const;
+	void match(const std::string& name, const Match& in, std::vector<Match>& out) const;
+	void compile(Program& program) const;
+	size_t memory() const;
+	void account(Profile& p, size_t depth) const;
+	const char* type() const;
+	std::unique_ptr<Generator> optimize();
 };
 
 
@@ -221,6 +893,8 @@ class Sequence : public Generator
 public:
 	Sequence();
 	Sequence(std::vector<std::unique_ptr<Generator>>&& generators_);
+
+	const char* type() const;
 };
 
 
@@ -231,10 +905,68 @@ class Literal : public Generator
 public:
 	Literal(const std::string& value_);
 
-	size_t combinations();
-	size_t min();
-	size_t max();
-	std::string toString();
+	const std::string& text() const;
+
+	using Generator::generate;
+	using Generator::nameAt;
+	void generate(std::string& out, Rng& rng) const;
+	void reach(Lengths& l, size_t in) const;
+	void fit(Lengths& l, const std::vector<const double*>& after) const;
+	void generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const;
+	void nameAt(std::string& out, size_t index) const;
+	void match(const std::string& name, const Match& in, std::vector<Match>& out) const;
+	void compile(Program& program) const;
+	size_t memory() const;
+	void account(Profile& p, size_t depth) const;
+	const char* type() const;
+	std::unique_ptr<Generator> optimize();
+	std::unique_ptr<Generator> transform(void (*f)(std::string& s, size_t from)) const;
+};
+
+
+/**
+ * A random choice among a range of strings in a packed Batch, as
+ * Random over Literals but without a node per string. Pattern symbols
+ * compile to these, all pointing into one interned table shared by
+ * every occurrence and every compiled generator. The optimizer packs
+ * choices among literals into tables of their own.
+ */
+class Table : public Generator
+{
+	std::shared_ptr<const Batch> strings;
+	size_t first;
+	size_t count;
+	std::shared_ptr<const Alias> alias;  // for weighted strings
+
+public:
+	Table(const std::shared_ptr<const Batch>& strings_, size_t first_, size_t count_,
+	      const std::shared_ptr<const Alias>& alias_=nullptr);
+
+	// Table for pattern symbol `c', or nullptr if `c' is not a symbol.
+	static std::unique_ptr<Table> Symbol(char c);
+
+	// One-entry table for the literal byte `c'.
+	static std::unique_ptr<Table> Character(char c);
+
+	// Table over its own copy of `strings', with their weights if any.
+	static std::unique_ptr<Table> Pack(const std::vector<std::string>& strings,
+	                                   const std::shared_ptr<const Alias>& alias=nullptr);
+
+	using Generator::generate;
+	using Generator::nameAt;
+	void generate(std::string& out, Rng& rng) const;
+	double chance(size_t index) const;
+	void reach(Lengths& l, size_t in) const;
+	void fit(Lengths& l, const std::vector<const double*>& after) const;
+	void generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const;
+	void nameAt(std::string& out, size_t index) const;
+	void match(const std::string& name, const Match& in, std::vector<Match>& out) const;
+	void compile(Program& program) const;
+	size_t memory() const;
+	void account(Profile& p, size_t depth) const;
+	const char* type() const;
+	std::unique_ptr<Generator> optimize();
+	std::unique_ptr<Generator> transform(void (*f)(std::string& s, size_t from)) const;
 };
 
 
@@ -242,7 +974,17 @@ class Reverser : public Generator {
 public:
 	Reverser(std::unique_ptr<Generator>&& g);
 
-	std::string toString();
+	using Generator::generate;
+	using Generator::nameAt;
+	void generate(std::string& out, Rng& rng) const;
+	void reach(Lengths& l, size_t in) const;
+	void fit(Lengths& l, const std::vector<const double*>& after) const;
+	void generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const;
+	void nameAt(std::string& out, size_t index) const;
+	void match(const std::string& name, const Match& in, std::vector<Match>& out) const;
+	void compile(Program& program) const;
+	const char* type() const;
+	std::unique_ptr<Generator> optimize();
 };
 
 
@@ -251,7 +993,17 @@ class Capitalizer : public Generator
 public:
 	Capitalizer(std::unique_ptr<Generator>&& g);
 
-	std::string toString();
+	using Generator::generate;
+	using Generator::nameAt;
+	void generate(std::string& out, Rng& rng) const;
+	void reach(Lengths& l, size_t in) const;
+	void fit(Lengths& l, const std::vector<const double*>& after) const;
+	void generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const;
+	void nameAt(std::string& out, size_t index) const;
+	void match(const std::string& name, const Match& in, std::vector<Match>& out) const;
+	void compile(Program& program) const;
+	const char* type() const;
+	std::unique_ptr<Generator> optimize();
 };
 
 
@@ -260,9 +1012,816 @@ class Collapser : public Generator
 public:
 	Collapser(std::unique_ptr<Generator>&& g);
 
+	using Generator::generate;
+	using Generator::nameAt;
+	void generate(std::string& out, Rng& rng) const;
+	void reach(Lengths& l, size_t in) const;
+	void fit(Lengths& l, const std::vector<const double*>& after) const;
+	void generate(std::string& out, size_t& state, size_t& bytes, const Lengths& l, Rng& rng) const;
+	void nameAt(std::string& out, size_t index) const;
+	void match(const std::string& name, const Match& in, std::vector<Match>& out) const;
+	void compile(Program& program) const;
+	const char* type() const;
+	std::unique_ptr<Generator> optimize();
+};
+
+
+/**
+ * A Program laid out in static storage, as StaticGenerator does while
+ * building, or in the arena of a Program. Running it needs neither a
+ * parse nor an allocation of its own.
+ */
+struct StaticProgram
+{
+	const uint32_t* code;
+	const char* pool;
+	const uint32_t* index;
+	size_t depth;  // deepest nesting of marks
+	const char* shared_pool;  // of the symbol tables every Program shares
+	const uint32_t* shared_index;
+
+	void generate(std::string& out, Rng& rng) const;
+	size_t generate(char* dst, size_t len, Rng& rng) const noexcept;
+
+	std::string toString() const;
+	std::string toString(Rng& rng) const;
+	void generate(std::string& out) const;
+	size_t generate(char* dst, size_t len) const noexcept;
+};
+
+
+/**
+ * Where a Program gets its arena from: a pair of functions and the
+ * state they share, so that any kind of memory resource can be plugged
+ * in without the library depending on one. The default is the heap.
+ * From C++17 on, allocator() adapts a std::pmr::memory_resource.
+ */
+struct Allocator
+{
+	void* (*allocate)(void* state, size_t bytes);  // aligned for uint32_t
+	void (*deallocate)(void* state, void* p, size_t bytes);  // or null to never free
+	void* state;
+
+	Allocator();
+	Allocator(void* (*allocate_)(void*, size_t), void (*deallocate_)(void*, void*, size_t), void* state_);
+};
+
+
+/**
+ * A Generator lowered into one contiguous instruction array and a
+ * packed string pool, run by a non-virtual interpreter loop. For the
+ * same random stream it produces the same names as the tree it was
+ * compiled from, without chasing pointers through heap nodes.
+ *
+ * Instructions are 32-bit words, an opcode followed by its operands:
+ *
+ *   literal offset length   - append a string from the pool
+ *   table at n              - append one of n strings from the pool
+ *   random n target...      - jump to one of n targets at random
+ *   weighted_random n total prob... alias... target...
+ *                           - the same, weighted through an alias table
+ *   weighted_table at n total prob... alias...
+ *                           - append one of n weighted strings
+ *   symbol at n             - append one of n strings of the symbols
+ *   jump target             - continue at target
+ *   mark                    - remember where the output currently ends
+ *   capitalize / reverse / collapse
+ *                           - transform the output since the last mark
+ *   halt                    - stop
+ *
+ * where table string i runs from index[at + i] to index[at + i + 1] in
+ * the pool. Symbols are read from one pool and index of every symbol
+ * string, laid out the same way and shared by every Program, as trees
+ * share them. Once compiled, the code, the index and the pool, strings
+ * of tables included, share a single allocation, and the Program keeps
+ * nothing of the tree it came from, nor anything it only needed while
+ * compiling. The bundled patterns take three to seven times less
+ * memory as Programs than as trees.
+ */
+class Program
+{
+	Allocator source;
+	uint32_t* arena;
+	size_t words;
+	StaticProgram packed;
+	size_t longest;
+	double expected;   // mean length of a name
+	bool collapsing;   // whole names, after the code has run
+
+	// What compile() builds up, until it is packed into the arena
+	struct Build;
+	std::unique_ptr<Build> build;
+
+	uint32_t* reserve(size_t n);
+	void pack();
+
+public:
+	typedef enum opcodes : uint32_t {
+		halt,
+		literal,
+		table,
+		random,
+		jump,
+		mark,
+		capitalize,
+		reverse,
+		collapse,
+		weighted_random,
+		weighted_table,
+		symbol
+	} opcodes_t;
+
+	// The arena comes from `allocator', as do those of copies.
+	Program(const Generator& generator, const Allocator& allocator=Allocator());
+	Program(const std::string& pattern, bool collapse_triples=true, const Allocator& allocator=Allocator());
+	Program(const Program& other);
+	Program(Program&& other) noexcept;
+	Program& operator=(Program other);
+	~Program();
+
+	size_t max() const;
+	double mean() const;
+	void generate(std::string& out, Rng& rng) const;
+	size_t generate(char* dst, size_t len, Rng& rng) const noexcept;
+
+	std::string toString() const;
+	std::string toString(Rng& rng) const;
+	void generate(std::string& out) const;
+	size_t generate(char* dst, size_t len) const noexcept;
+
+	Batch generateBatch(size_t n, Rng& rng) const;
+	Batch generateBatch(size_t n) const;
+
+	// Bytes of memory held, as Generator::memory() counts them.
+	size_t memory() const;
+
+	// Whether triples are collapsed over whole names after the code has
+	// run, and over whole batches at once, rather than by the code.
+	bool collapses() const;
+
+	// Used by Generator::compile() to emit code
+	size_t size() const;
+	void emit(uint32_t word);
+	void patch(size_t at, uint32_t word);
+	void emit(const std::string& value);
+	void emit(const std::shared_ptr<const Batch>& strings, size_t first, size_t count, const Alias* alias=nullptr);
+	void open();
+	void close(opcodes_t op);
+
+	// Whether `g', about to be compiled as a collapse of its output, is
+	// the whole program, in which case the collapse is left to run over
+	// whole names, or whole batches of them, after the code.
+	bool defer(const Generator& g);
+};
+
+
+/**
+ * Generate `count' names across `threads' threads (0 for one per core).
+ * The work is cut into fixed-size chunks, each with its own Rng stream
+ * derived from `seed' and the chunk number, so the output for a given
+ * seed is identical whatever the number of threads. Chunks are returned
+ * in order, each in the Batch it was generated into.
+ */
+std::vector<Batch> bulkGenerate(const Program& program, size_t count, uint64_t seed, unsigned threads=0, Rng::engines_t engine=Rng::xoshiro256);
+std::vector<Batch> bulkGenerate(const std::string& pattern, size_t count, uint64_t seed, unsigned threads=0, Rng::engines_t engine=Rng::xoshiro256);
+
+/**
+ * The names bulkGenerate() would return, handed to `sink' one chunk at
+ * a time and in order, on the calling thread, while the other threads
+ * carry on generating. Only a few chunks per thread are held at once,
+ * so any count can be streamed in bounded memory. The sink may keep a
+ * chunk by moving from it. Exceptions from the sink, or from starting
+ * a thread, stop generation and are rethrown once the threads started
+ * have finished.
+ */
+void streamGenerate(const Program& program, size_t count, uint64_t seed, const std::function<void(Batch& chunk)>& sink,
+                    unsigned threads=0, Rng::engines_t engine=Rng::xoshiro256);
+
+
+/**
+ * Generate a name straight from the text of `pattern', with nothing
+ * compiled, much as namegen() in the C version does. This is the
+ * cheapest way to use a pattern once. Each thread reads the last
+ * pattern it was given into a table of its groups, in one pass, and
+ * reuses it while the pattern stays the same, so a name only costs
+ * the alternatives it is made of. The
+ * names are the same as those of a Generator for the same pattern,
+ * options and Rng, and invalid patterns throw the same exceptions.
+ */
+void generate(std::string& out, const std::string& pattern, Rng& rng, bool collapse_triples=true);
+std::string generate(const std::string& pattern, Rng& rng, bool collapse_triples=true);
+std::string generate(const std::string& pattern, bool collapse_triples=true);
+
+
+/**
+ * A pattern generated from directly while it is used only a few times,
+ * and compiled into a Program once it has been used often enough for
+ * compiling to pay off. The names are the same either way. A caller
+ * that knows how many names it will want can say so, and a pattern
+ * expected to be used at least `threshold' times is compiled at once.
+ * Invalid patterns throw from the constructor. Any number of threads
+ * can share one.
+ */
+class Adaptive
+{
+	std::string pattern;
+	bool collapse_triples;
+	std::atomic<size_t> uses;
+	std::once_flag once;
+	std::unique_ptr<Program> program;
+	std::atomic<bool> ready;
+
+	const Program* compiled(size_t n);
+
+public:
+	static const size_t threshold;
+
+	Adaptive(const std::string& pattern_, bool collapse_triples_=true, size_t expected=0);
+
+	bool isCompiled() const;
+
 	std::string toString();
+	std::string toString(Rng& rng);
+	void generate(std::string& out);
+	void generate(std::string& out, Rng& rng);
+
+	Batch generateBatch(size_t n, Rng& rng);
+	Batch generateBatch(size_t n);
 };
 
+
+/**
+ * A bounded, thread-safe cache of compiled patterns, keyed by pattern
+ * and collapse_triples. Lookups lock one of several shards only long
+ * enough to find the entry and mark it as recently used. Concurrent
+ * misses on the same pattern wait for a single compilation. Once the
+ * memory() of all the entries exceeds the budget, generators are
+ * evicted, least recently used first: those of the shard just added to,
+ * then those of the others. Recency is kept per shard, so it is only
+ * least recently used overall on average. The generator just added is
+ * never the one evicted, and one larger than the whole budget is
+ * returned without being kept. Holders of an evicted generator keep it
+ * alive for as long as they need it.
+ */
+class Cache
+{
+	typedef std::shared_future<std::shared_ptr<const Generator>> future_t;
+
+	struct Entry {
+		std::string key;
+		future_t generator;
+		size_t memory;
+	};
+
+	struct Shard {
+		std::mutex lock;
+		std::list<Entry> entries;  // most recently used first
+		std::unordered_map<std::string, std::list<Entry>::iterator> index;
+		size_t memory = 0;
+	};
+
+	static const size_t shards_count = 16;
+
+	Shard shards[shards_count];
+	size_t budget;
+	std::atomic<size_t> memory;  // of every shard
+	std::atomic<size_t> hits;
+	std::atomic<size_t> misses;
+	std::atomic<size_t> evictions;
+
+	// Evict from `shard' while over budget, least recently used first,
+	// but never the entry for the key `keep', if there is one.
+	void evict(Shard& shard, const std::string* keep);
+
+public:
+	struct Stats {
+		size_t hits;
+		size_t misses;
+		size_t evictions;
+		size_t entries;
+		size_t memory;
+	};
+
+	Cache(size_t budget_=64 << 20);
+
+	// The process-wide cache.
+	static Cache& global();
+
+	// Compiled generator for `pattern', compiling it on a miss. Throws
+	// what the Generator constructor throws for invalid patterns, which
+	// are not cached.
+	std::shared_ptr<const Generator> get(const std::string& pattern, bool collapse_triples=true);
+
+	Stats stats();
+	void clear();
+};
+
+
+#if __cplusplus >= 202002L
+
+namespace Static {
+
+// A pattern passed as a template argument.
+template <size_t N>
+struct Pattern {
+	char text[N];
+
+	constexpr Pattern(const char (&s)[N]) :
+		text()
+	{
+		for (size_t i = 0; i < N; i++) {
+			text[i] = s[i];
+		}
+	}
+};
+
+template <size_t W, size_t P, size_t I>
+struct Code {
+	uint32_t code[W];
+	char pool[P ? P : 1];
+	uint32_t index[I ? I : 1];
+	size_t depth;
+};
+
+/**
+ * Compiles a pattern of N - 1 bytes to the code of a StaticProgram.
+ * It makes the same random choices as the optimized tree, so that both
+ * draw the same names from the same Rng. With zero capacities nothing is
+ * stored and only the sizes are worked out. Invalid patterns throw,
+ * which fails the build when evaluated as a constant expression.
+ */
+template <size_t N, size_t W, size_t P, size_t I>
+struct Compiler {
+	uint32_t code[W ? W : 1] = {};
+	char pool[P ? P : 1] = {};
+	uint32_t index[I ? I : 1] = {};
+	size_t words = 0;
+	size_t bytes = 0;
+	size_t entries = 0;
+	size_t depth = 0;
+	size_t max_depth = 0;
+
+	char wrappers[N] = {};       // '!' or '~' waiting for the next element
+	size_t pending = 0;
+	uint32_t symbols[128] = {};  // first index entry of a symbol, plus one
+	size_t run = 0;              // end of the last literal, if it can grow
+
+	// Alternatives of the groups being compiled, innermost last
+	struct Alternative {
+		size_t start, end;
+		uint32_t weight;
+		bool wrapped;  // wrappers were pending at its start
+		bool folded;   // the same as the one before, and so one with it
+	};
+	Alternative alternatives[N] = {};
+	size_t top = 0;
+
+	constexpr void emit(uint32_t word)
+	{
+		if (words < W) {
+			code[words] = word;
+		}
+		words++;
+	}
+
+	constexpr void patch(size_t at, uint32_t word)
+	{
+		if (at < W) {
+			code[at] = word;
+		}
+	}
+
+	constexpr uint32_t peek(size_t at) const
+	{
+		return at < W ? code[at] : 0;
+	}
+
+	constexpr void append(char c)
+	{
+		if (bytes < P) {
+			pool[bytes] = c;
+		}
+		bytes++;
+	}
+
+	constexpr void entry()
+	{
+		if (entries < I) {
+			index[entries] = bytes;
+		}
+		entries++;
+	}
+
+	constexpr void open()
+	{
+		emit(Program::mark);
+		if (++depth > max_depth) {
+			max_depth = depth;
+		}
+	}
+
+	constexpr void close(uint32_t op)
+	{
+		emit(op);
+		depth--;
+	}
+
+	// Open a mark for each wrapper pending since `base'.
+	constexpr void wrap(size_t base)
+	{
+		for (size_t i = base; i < pending; i++) {
+			open();
+		}
+	}
+
+	// Close them again, the last one given innermost.
+	constexpr void unwrap(size_t base)
+	{
+		while (pending > base) {
+			close(wrappers[--pending] == '!' ? Program::capitalize : Program::reverse);
+		}
+	}
+
+	// Point the jumps chained from `at' to the current end.
+	constexpr void land(size_t at)
+	{
+		while (at) {
+			size_t next = peek(at - 1);
+			patch(at - 1, words);
+			at = next;
+		}
+	}
+
+	// Literal bytes, joined as the optimizer joins them
+	constexpr void character(char c)
+	{
+		if (run && run == words) {
+			patch(words - 1, peek(words - 1) + 1);
+		} else {
+			emit(Program::literal);
+			emit(bytes);
+			emit(1);
+			run = words;
+		}
+		append(c);
+	}
+
+	// Table for symbol `c', or false if `c' is not a symbol.
+	constexpr bool symbol(char c)
+	{
+		for (auto& symbol : Symbols::all) {
+			if (symbol.symbol != c) {
+				continue;
+			}
+			unsigned char u = c;
+			if (!symbols[u]) {
+				symbols[u] = entries + 1;
+				entry();
+				for (size_t i = 0; i < symbol.count; i++) {
+					for (const char* s = symbol.strings[i]; *s; s++) {
+						append(*s);
+					}
+					entry();
+				}
+			}
+			emit(Program::table);
+			emit(symbols[u] - 1);
+			emit(symbol.count);
+			return true;
+		}
+		return false;
+	}
+
+	// Weight "^N" at text[i], read as weight() in namegen.cc reads it:
+	// its length, or 0 if there is no caret there
+	constexpr size_t weight(const char* text, size_t n, size_t i, uint32_t& weight)
+	{
+		size_t end = i + 1;
+		uint64_t value = 0;
+		if (text[i] != '^') {
+			return 0;
+		}
+		while (end < n && text[end] >= '0' && text[end] <= '9') {
+			value = value * 10 + (text[end++] - '0');
+			if (value > UINT32_MAX) {
+				value = UINT32_MAX + uint64_t(1);
+			}
+		}
+		char next = end < n ? text[end] : '|';
+		if (end == i + 1) {
+			throw std::invalid_argument("Missing weight after '^' in pattern");
+		} else if (next != '|' && next != ')' && next != '>') {
+			throw std::invalid_argument("Weight not at the end of an alternative in pattern");
+		} else if (!value) {
+			throw std::invalid_argument("Zero weight in pattern");
+		} else if (value > UINT32_MAX) {
+			throw std::invalid_argument("Weight too large in pattern");
+		}
+		weight = value;
+		return end - i;
+	}
+
+	// The choice between the alternatives from `first' on, as
+	// Random::compile() emits it, less the targets
+	constexpr void choose(size_t first, size_t choices)
+	{
+		uint32_t weights[N] = {};
+		uint64_t total = 0;
+		bool weighted = false;
+		for (size_t k = first, j = 0; k < top; k++) {
+			const Alternative& a = alternatives[k];
+			if (a.folded) {
+				weights[j - 1] += a.weight;
+			} else {
+				weights[j++] = a.weight;
+			}
+			weighted |= a.folded || a.weight != 1;
+			total += a.weight;
+			if (total > UINT32_MAX / choices) {
+				throw std::invalid_argument("Weights too large");
+			}
+		}
+		if (!weighted) {
+			emit(Program::random);
+			emit(choices);
+			return;
+		}
+		uint32_t prob[N] = {};
+		uint32_t alias[N] = {};
+		uint32_t work[N] = {};
+		vose<uint32_t>(weights, choices, total, prob, alias, work);
+		emit(Program::weighted_random);
+		emit(choices);
+		emit(total);
+		for (size_t j = 0; j < choices; j++) {
+			emit(prob[j]);
+		}
+		for (size_t j = 0; j < choices; j++) {
+			emit(alias[j]);
+		}
+	}
+
+	// Compile the group from text[i], just past its opening bracket
+	// `type' ('<', '(', or 0 for the whole pattern), and return the
+	// position just past its closing bracket.
+	constexpr size_t group(const char* text, size_t n, size_t i, char type)
+	{
+		// Find the alternatives and their weights first, folding runs
+		// of the same text as Group::produce() does
+		size_t first = top;
+		size_t end = i;
+		alternatives[top++] = {i, n, 1, false, false};
+		for (size_t nesting = 0; end < n; end++) {
+			char c = text[end];
+			if (c == '<' || c == '(') {
+				nesting++;
+			} else if (c == '>' || c == ')') {
+				if (!nesting) {
+					break;
+				}
+				nesting--;
+			} else if (nesting) {
+				continue;
+			} else if (c == '|') {
+				Alternative& a = alternatives[top - 1];
+				if (a.end > end) {
+					a.end = end;
+				}
+				// Wrappers still pending carry over to the next one
+				bool wrapped = type != '(' && (a.end > a.start ?
+				               text[a.end - 1] == '!' || text[a.end - 1] == '~' : a.wrapped);
+				alternatives[top++] = {end + 1, n, 1, wrapped, false};
+			} else if (size_t length = weight(text, n, end, alternatives[top - 1].weight)) {
+				alternatives[top - 1].end = end;
+				end += length - 1;
+			}
+		}
+		if (alternatives[top - 1].end > end) {
+			alternatives[top - 1].end = end;
+		}
+
+		size_t choices = 1;
+		for (size_t k = first + 1; k < top; k++) {
+			Alternative& a = alternatives[k];
+			const Alternative& b = alternatives[k - 1];
+			size_t length = a.end - a.start;
+			a.folded = !a.wrapped && !b.wrapped && length == b.end - b.start;
+			for (size_t j = 0; a.folded && j < length; j++) {
+				a.folded = text[a.start + j] == text[b.start + j];
+			}
+			choices += !a.folded;
+		}
+
+		// As in Random::compile(), with the jumps to the end chained
+		// through their operands until the end is known
+		size_t targets = 0;
+		size_t choice = 0;
+		size_t jumps = 0;
+		if (choices > 1) {
+			choose(first, choices);
+			targets = words;
+			for (size_t j = 0; j < choices; j++) {
+				emit(0);
+			}
+		}
+
+		size_t base = pending;
+		for (size_t k = first; k < top; k++) {
+			if (alternatives[k].folded) {
+				continue;
+			}
+			if (choice) {
+				emit(Program::jump);
+				emit(jumps);
+				jumps = words;
+			}
+			if (choices > 1) {
+				patch(targets + choice++, words);
+			}
+			for (i = alternatives[k].start; i < alternatives[k].end; i++) {
+				char c = text[i];
+				switch (c) {
+					case '<':
+					case '(':
+						wrap(base);
+						i = group(text, n, i + 1, c) - 1;
+						unwrap(base);
+						break;
+					case '!':
+					case '~':
+						if (type != '(') {
+							wrappers[pending++] = c;
+							break;
+						}
+						// fall through
+					default:
+						wrap(base);
+						if (type == '(' || !symbol(c)) {
+							character(c);
+						}
+						unwrap(base);
+						break;
+				}
+			}
+		}
+		top = first;
+		pending = base;
+		land(jumps);
+		if (choices > 1) {
+			// Other alternatives land here, past the last literal
+			run = 0;
+		}
+
+		if (end == n) {
+			if (type) {
+				throw std::invalid_argument("Missing closing bracket");
+			}
+			return n;
+		}
+		char c = text[end];
+		if (!type) {
+			throw std::invalid_argument("Unbalanced brackets");
+		} else if (c == '>' && type != '<') {
+			throw std::invalid_argument("Unexpected '>' in pattern");
+		} else if (c == ')' && type != '(') {
+			throw std::invalid_argument("Unexpected ')' in pattern");
+		}
+		return end + 1;
+	}
+
+	constexpr Compiler(const char* text, bool collapse_triples)
+	{
+		if (collapse_triples) {
+			open();
+		}
+		group(text, N - 1, 0, 0);
+		if (collapse_triples) {
+			close(Program::collapse);
+		}
+		emit(Program::halt);
+	}
+};
+
+template <size_t N, size_t W, size_t P, size_t I>
+constexpr Code<W, P, I> compile(const char* text, bool collapse_triples)
+{
+	Compiler<N, W, P, I> compiler(text, collapse_triples);
+	Code<W, P, I> out = {};
+	for (size_t i = 0; i < W; i++) {
+		out.code[i] = compiler.code[i];
+	}
+	for (size_t i = 0; i < P; i++) {
+		out.pool[i] = compiler.pool[i];
+	}
+	for (size_t i = 0; i < I; i++) {
+		out.index[i] = compiler.index[i];
+	}
+	out.depth = compiler.max_depth;
+	return out;
+}
+
+}
+
+
+/**
+ * A generator for a pattern known while building, typically one of the
+ * pattern macros:
+ *
+ *   NameGen::StaticGenerator<MIDDLE_EARTH> generator;
+ *   std::string name = generator.toString();
+ *
+ * The pattern is parsed and checked by the compiler, so an invalid one
+ * fails the build, and its program lives in read-only data, so nothing
+ * is parsed or allocated at startup. Names are the same as those of a
+ * Generator or Program for the same pattern and Rng. Requires C++20.
+ */
+template <Static::Pattern pattern, bool collapse_triples=true>
+class StaticGenerator
+{
+	static constexpr size_t length = sizeof(pattern.text);
+	static constexpr Static::Compiler<length, 0, 0, 0> sizes{pattern.text, collapse_triples};
+	static constexpr auto code = Static::compile<length, sizes.words, sizes.bytes, sizes.entries>(pattern.text, collapse_triples);
+
+public:
+	static constexpr StaticProgram program = {code.code, code.pool, code.index, code.depth, nullptr, nullptr};
+
+	std::string toString() const { return program.toString(); }
+	std::string toString(Rng& rng) const { return program.toString(rng); }
+	void generate(std::string& out) const { program.generate(out); }
+	void generate(std::string& out, Rng& rng) const { program.generate(out, rng); }
+	size_t generate(char* dst, size_t len) const noexcept { return program.generate(dst, len); }
+	size_t generate(char* dst, size_t len, Rng& rng) const noexcept { return program.generate(dst, len, rng); }
+};
+
+#endif
+
+
+#if __cplusplus >= 201703L
+
+/**
+ * Memory from a std::pmr::memory_resource, so that compiling and
+ * generating can draw on request-scoped storage:
+ *
+ *   std::pmr::monotonic_buffer_resource arena;
+ *   NameGen::Program program(pattern, true, NameGen::allocator(&arena));
+ *   std::pmr::string name = NameGen::toString(program, rng, &arena);
+ *
+ * The resource must outlive whatever is allocated from it. While a
+ * pattern is compiled, its tree is built on the heap and freed before
+ * the Program is returned; only the Program's arena stays behind.
+ */
+inline Allocator allocator(std::pmr::memory_resource* resource)
+{
+	return Allocator(
+		[](void* state, size_t bytes) {
+			return static_cast<std::pmr::memory_resource*>(state)->allocate(bytes, alignof(uint32_t));
+		},
+		[](void* state, void* p, size_t bytes) {
+			static_cast<std::pmr::memory_resource*>(state)->deallocate(p, bytes, alignof(uint32_t));
+		},
+		resource);
+}
+
+// A name from a Generator, Program, StaticGenerator or Adaptive,
+// appended to `out' with its allocator, or returned in a string
+// allocated from `resource'.
+template <typename T>
+void generate(std::pmr::string& out, T& generator, Rng& rng)
+{
+	static thread_local std::string scratch;
+	const void* data = scratch.data();
+	scratch.clear();
+	generator.generate(scratch, rng);
+	Counter::grown(scratch, data);
+	out.append(scratch);
+}
+
+template <typename T>
+std::pmr::string toString(T& generator, Rng& rng, std::pmr::memory_resource* resource=std::pmr::get_default_resource())
+{
+	std::pmr::string out(resource);
+	generate(out, generator, rng);
+	Counter::returned(out);
+	return out;
+}
+
+// A name generated straight from the text of `pattern', as generate()
+// does, in a string allocated from `resource'.
+inline std::pmr::string generate(const std::string& pattern, Rng& rng, std::pmr::memory_resource* resource,
+                                 bool collapse_triples=true)
+{
+	static thread_local std::string scratch;
+	const void* data = scratch.data();
+	scratch.clear();
+	generate(scratch, pattern, rng, collapse_triples);
+	Counter::grown(scratch, data);
+	std::pmr::string name(scratch, resource);
+	Counter::returned(name);
+	return name;
+}
+
+#endif
+
 }
 
 std::wstring towstring(const std::string& s);